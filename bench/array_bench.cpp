@@ -0,0 +1,51 @@
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include "../src/interpreter.hpp"
+
+// The same computation, sum(a[i] * 3 + 1), written once as a scalar loop and
+// once with the array builtins.
+static const char *loop = R"(
+var i = 0;
+var total = 0;
+while (i < n) { total = total + (i * 3 + 1); i = i + 1; }
+)";
+
+static const char *builtins = R"(
+var a = array(n);
+var i = 0;
+while (i < n) { a[i] = i; i = i + 1; }
+fun scale(x) { return x * 3 + 1; }
+var start = clock();
+var total = sum(map(a, scale));
+var elapsed = clock() - start;
+)";
+
+using benchClock = std::chrono::steady_clock;
+
+int main(int argc, char **argv) {
+  int n = argc > 1 ? std::stoi(argv[1]) : 1000000;
+  auto prefix = "var n = " + std::to_string(n) + ";";
+
+  {
+    Program program(prefix + loop);
+    Evaluator eval;
+    auto start = benchClock::now();
+    eval.run(program);
+    std::chrono::duration<double> elapsed = benchClock::now() - start;
+    std::cout << "while loop: " << n / elapsed.count() << " elements/s"
+              << std::endl;
+  }
+  {
+    // Filling the array is itself a scalar loop, so the script times just
+    // the map and sum.
+    Program program(prefix + builtins);
+    Evaluator eval;
+    eval.run(program);
+    Program result("elapsed;");
+    auto elapsed = fromValue<double>(eval.run(result));
+    std::cout << "map + sum: " << n / elapsed << " elements/s" << std::endl;
+  }
+  return 0;
+}
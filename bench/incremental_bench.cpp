@@ -0,0 +1,115 @@
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+
+#include "../src/incremental.hpp"
+#include "../src/parser.hpp"
+#include "../src/scanner.hpp"
+
+// A large script in the shape editors see: top-level functions with nested
+// loops and blocks, and top-level statements between them.
+std::string generateProgram(size_t functions) {
+  std::string src;
+  for (size_t i = 0; i < functions; i++) {
+    auto n = std::to_string(i);
+    src += "fun f" + n + "(a, b) {\n";
+    src += "  var v = a * " + n + " + (b - 2.5) / 3;\n";
+    src += "  while (v < " + n + ") {\n";
+    src += "    if (v <= 10) { v = v + 1; } else print v;\n";
+    src += "    { var tmp = v * 2 + 3; print tmp; }\n";
+    src += "  }\n";
+    src += "  // comment " + n + "\n";
+    src += "  return g(v, a)[1] >= 2;\n";
+    src += "}\n";
+    src += "var x" + n + " = f" + n + "(" + n + ", 7);\n";
+  }
+  return src;
+}
+
+static std::string dump(const std::vector<std::shared_ptr<Stmt>> &stmts) {
+  std::ostringstream os;
+  for (auto &stmt : stmts) {
+    os << *stmt << "\n";
+  }
+  return os.str();
+}
+
+int main(int argc, char **argv) {
+  size_t functions = argc > 1 ? std::stoul(argv[1]) : 20000;
+  int edits = argc > 2 ? std::stoi(argv[2]) : 2000;
+  auto source = generateProgram(functions);
+
+  using clock = std::chrono::steady_clock;
+  std::chrono::duration<double> fullTime(0);
+  int rounds = 3;
+  for (int r = 0; r < rounds; r++) {
+    auto t0 = clock::now();
+    auto scanner = Scanner(source);
+    auto parser = Parser(scanner.scanTokens());
+    auto program = parser.parseProgram();
+    fullTime += clock::now() - t0;
+  }
+
+  auto program = IncrementalProgram(source);
+  std::mt19937 rng(42);
+  std::chrono::duration<double> digitTime(0), lineTime(0), worst(0);
+  for (int i = 0; i < edits; i++) {
+    auto &text = program.source();
+    // Change a digit at the start of a number, then add a line and take it
+    // out again.
+    auto at = rng() % text.size();
+    while (at < text.size() &&
+           !(isdigit(text[at]) && (text[at - 1] == ' ' || text[at - 1] == '(')))
+      at++;
+    if (at == text.size())
+      continue;
+    auto t0 = clock::now();
+    program.edit(at, 1, std::string(1, '1' + rng() % 9));
+    auto t1 = clock::now();
+    auto line = text.find('\n', rng() % text.size());
+    if (line == std::string::npos)
+      continue;
+    program.edit(line + 1, 0, "x = x + 1;\n");
+    program.edit(line + 1, 11, "");
+    auto t2 = clock::now();
+    digitTime += t1 - t0;
+    lineTime += t2 - t1;
+    worst = std::max(worst, std::chrono::duration<double>(t1 - t0));
+  }
+
+  auto scanner = Scanner(program.source());
+  auto parser = Parser(scanner.scanTokens());
+  if (dump(parser.parseProgram()) != dump(program.statements())) {
+    std::cout << "incremental parse differs from a full one" << std::endl;
+    return 1;
+  }
+
+  // An edit that doesn't parse stays pending, even through one that changes
+  // nothing.
+  auto broken = IncrementalProgram("var z = 0;");
+  bool failed = false;
+  for (int i = 0; i < 2; i++) {
+    try {
+      i == 0 ? broken.edit(9, 1, "") : broken.edit(0, 0, "");
+    } catch (const ScriptError &) {
+      failed = i == 1;
+    }
+  }
+  if (!failed) {
+    std::cout << "unparsed edit was dropped" << std::endl;
+    return 1;
+  }
+
+  std::cout << "input: " << source.size() << " bytes, "
+            << program.statements().size() << " top-level statements"
+            << std::endl;
+  std::cout << "full parse:  " << fullTime.count() / rounds * 1e3 << " ms"
+            << std::endl;
+  std::cout << "digit edit:  " << digitTime.count() / edits * 1e6
+            << " us (worst " << worst.count() * 1e6 << " us)" << std::endl;
+  std::cout << "line edit:   " << lineTime.count() / (2 * edits) * 1e6 << " us"
+            << std::endl;
+  return 0;
+}
@@ -0,0 +1,55 @@
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "../src/interpreter.hpp"
+
+// Every isolate starts from the same compiled Program, defines its own
+// globals and then does a fixed amount of work. With nothing shared but the
+// read-only AST, throughput should grow linearly with the number of threads.
+static const char *source = R"(
+var calls = 0;
+fun fib(n) {
+  calls = calls + 1;
+  if (n < 2) return n;
+  return fib(n - 1) + fib(n - 2);
+}
+)";
+
+static void runIsolate(const Program &program, int jobs, int n) {
+  for (int i = 0; i < jobs; i++) {
+    Evaluator eval;
+    eval.run(program);
+    auto fib = eval.function("fib");
+    eval.invoke<double>(*fib, n);
+  }
+}
+
+int main(int argc, char **argv) {
+  int maxThreads = argc > 1 ? std::stoi(argv[1])
+                            : std::max(1u, std::thread::hardware_concurrency());
+  int jobs = argc > 2 ? std::stoi(argv[2]) : 20;
+  int n = argc > 3 ? std::stoi(argv[3]) : 15;
+  auto program = std::make_shared<const Program>(source);
+
+  using clock = std::chrono::steady_clock;
+  double base = 0;
+  for (int threads = 1; threads <= maxThreads; threads *= 2) {
+    auto start = clock::now();
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+      workers.emplace_back(runIsolate, std::cref(*program), jobs, n);
+    }
+    for (auto &worker : workers) {
+      worker.join();
+    }
+    std::chrono::duration<double> elapsed = clock::now() - start;
+    double rate = threads * jobs / elapsed.count();
+    if (threads == 1)
+      base = rate;
+    std::cout << threads << " isolates: " << rate << " runs/s, speedup "
+              << rate / base << " (ideal " << threads << ")" << std::endl;
+  }
+  return 0;
+}
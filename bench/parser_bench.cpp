@@ -0,0 +1,66 @@
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include "../src/parser.hpp"
+#include "../src/scanner.hpp"
+
+// Builds a program out of every construct the parser knows, so the benchmark
+// exercises each precedence level rather than just one hot path.
+std::string generateProgram(size_t stmts) {
+  std::string src;
+  for (size_t i = 0; i < stmts; i++) {
+    auto n = std::to_string(i);
+    switch (i % 5) {
+    case 0:
+      src += "var v" + n + " = " + n + " * (v + 2.5) - w / 3;\n";
+      break;
+    case 1:
+      src += "if (v" + n + " <= 10) { v = v + 1 } else print v\n";
+      break;
+    case 2:
+      src += "while (counter < " + n + ") counter = counter + 1\n";
+      break;
+    case 3:
+      src += "{ var tmp = 1; tmp = tmp * 2 + 3 print tmp }\n";
+      break;
+    case 4:
+      src += "// comment " + n + "\nx = y = z + 1 >= 2\n";
+      break;
+    }
+  }
+  return src;
+}
+
+int main(int argc, char **argv) {
+  size_t stmts = argc > 1 ? std::stoul(argv[1]) : 200000;
+  int rounds = argc > 2 ? std::stoi(argv[2]) : 5;
+  auto source = generateProgram(stmts);
+
+  using clock = std::chrono::steady_clock;
+  std::chrono::duration<double> scanTime(0), parseTime(0);
+  size_t tokenCount = 0, stmtCount = 0;
+  for (int r = 0; r < rounds; r++) {
+    auto t0 = clock::now();
+    auto scanner = Scanner(source);
+    auto &tokens = scanner.scanTokens();
+    auto t1 = clock::now();
+    auto parser = Parser(tokens);
+    auto program = parser.parseProgram();
+    auto t2 = clock::now();
+    scanTime += t1 - t0;
+    parseTime += t2 - t1;
+    tokenCount = tokens.size();
+    stmtCount = program.size();
+  }
+
+  double mb = source.size() * rounds / 1e6;
+  double ktok = tokenCount * rounds / 1e3;
+  std::cout << "input: " << source.size() << " bytes, " << tokenCount
+            << " tokens, " << stmtCount << " statements" << std::endl;
+  std::cout << "scan:  " << mb / scanTime.count() << " MB/s, "
+            << ktok / scanTime.count() << " ktok/s" << std::endl;
+  std::cout << "parse: " << mb / parseTime.count() << " MB/s, "
+            << ktok / parseTime.count() << " ktok/s" << std::endl;
+  return 0;
+}
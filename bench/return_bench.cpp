@@ -0,0 +1,79 @@
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include "../src/interpreter.hpp"
+
+// Every level returns from inside a loop, an if and a block, so each return
+// has to get out through three enclosing statements before its call ends.
+static const char *deepReturn = R"(
+fun down(n) {
+  while (true) {
+    if (n == 0) { return 0; }
+    { return down(n - 1) + 1; }
+  }
+}
+)";
+
+using benchClock = std::chrono::steady_clock;
+
+// What each of those returns would cost on top if return were a C++
+// exception: a throw out of the few visit frames between a return statement
+// and the call it ends.
+struct Unwind {
+  int value;
+};
+
+__attribute__((noinline)) static int escape(int frames) {
+  if (frames == 0)
+    throw Unwind{0};
+  return escape(frames - 1) + 1;
+}
+
+__attribute__((noinline)) static int throwingReturn() {
+  try {
+    return escape(4);
+  } catch (const Unwind &u) {
+    return u.value;
+  }
+}
+
+template <typename F> static double nsPerFrame(int depth, int reps, F f) {
+  auto start = benchClock::now();
+  for (int i = 0; i < reps; i++) {
+    f();
+  }
+  std::chrono::duration<double, std::nano> elapsed = benchClock::now() - start;
+  return elapsed.count() / (double(depth) * reps);
+}
+
+static volatile int sink;
+
+int main(int argc, char **argv) {
+  int reps = argc > 1 ? std::stoi(argv[1]) : 200;
+
+  const int depths[] = {10, 100, 1000};
+
+  // down(n) has n + 1 calls in progress at its deepest, one more than the
+  // default depth allows at 1000.
+  Budget budget;
+  budget.depth = depths[2] + 1;
+  Program program(deepReturn);
+  Evaluator eval;
+  eval.setBudget(budget);
+  eval.run(program);
+  auto down = eval.function("down");
+
+  for (int depth : depths) {
+    double lox = nsPerFrame(depth, reps, [&] {
+      sink = eval.invoke<int>(*down, depth);
+    });
+    std::cout << "depth " << depth << ": " << lox << " ns per call and return"
+              << std::endl;
+  }
+  double thrown =
+      nsPerFrame(1, reps * 1000, [&] { sink = throwingReturn(); });
+  std::cout << "returning by exception would add " << thrown
+            << " ns per return" << std::endl;
+  return 0;
+}
@@ -0,0 +1,72 @@
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+#include "../src/interpreter.hpp"
+
+// A prelude that does real work before the script proper starts: it sieves a
+// table of primes and defines a handful of helpers over it.
+static const char *prelude = R"(
+var limit = 20000;
+var sieve = array(limit);
+var primes = transient(list());
+var i = 2;
+while (i < limit) {
+  if (sieve[i] == 0) {
+    push(primes, i);
+    var j = i * i;
+    while (j < limit) {
+      sieve[j] = 1;
+      j = j + i;
+    }
+  }
+  i = i + 1;
+}
+primes = persistent(primes);
+fun nthPrime(n) { return get(primes, n); }
+fun isPrime(n) { return sieve[n] == 0; }
+var names = dict();
+var k = 0;
+while (k < 500) {
+  names = put(names, k, "prime number " + "#" + "...");
+  k = k + 1;
+}
+)";
+
+using benchClock = std::chrono::steady_clock;
+
+template <typename F> static double msPerRun(int reps, F f) {
+  auto start = benchClock::now();
+  for (int i = 0; i < reps; i++) {
+    f();
+  }
+  std::chrono::duration<double, std::milli> elapsed = benchClock::now() - start;
+  return elapsed.count() / reps;
+}
+
+int main(int argc, char **argv) {
+  int reps = argc > 1 ? std::stoi(argv[1]) : 20;
+  std::string image = argc > 2 ? argv[2] : "snapshot_bench.img";
+
+  Program program(prelude);
+  {
+    Evaluator eval;
+    eval.run(program);
+    eval.saveSnapshot(image);
+  }
+
+  double run = msPerRun(reps, [&] {
+    Evaluator eval;
+    eval.run(program);
+  });
+  double load = msPerRun(reps, [&] {
+    Evaluator eval;
+    eval.loadSnapshot(image);
+  });
+  std::cout << "running the prelude: " << run << " ms" << std::endl;
+  std::cout << "loading its snapshot: " << load << " ms (" << run / load
+            << "x faster)" << std::endl;
+  std::remove(image.c_str());
+  return 0;
+}
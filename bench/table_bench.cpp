@@ -0,0 +1,88 @@
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../src/table.hpp"
+
+using benchClock = std::chrono::steady_clock;
+
+// Keeps the optimizer from dropping lookups whose result is unused.
+static volatile long sink;
+
+static std::vector<std::string> symbols(size_t n) {
+  std::vector<std::string> names;
+  for (size_t i = 0; i < n; i++) {
+    names.push_back("symbol_" + std::to_string(i * 7919 % 100003));
+  }
+  return names;
+}
+
+// Inserts every name, then looks each one up until about a million lookups
+// have been done. Reports nanoseconds per insert and per lookup.
+template <typename Insert, typename Find>
+static void measure(const char *label, const std::vector<std::string> &names,
+                    Insert insert, Find find) {
+  auto start = benchClock::now();
+  for (size_t i = 0; i < names.size(); i++) {
+    insert(names[i], long(i));
+  }
+  std::chrono::duration<double, std::nano> inserting =
+      benchClock::now() - start;
+
+  size_t rounds = 1000000 / names.size() + 1;
+  long total = 0;
+  start = benchClock::now();
+  for (size_t r = 0; r < rounds; r++) {
+    for (auto &name : names) {
+      total += find(name);
+    }
+  }
+  std::chrono::duration<double, std::nano> finding = benchClock::now() - start;
+  sink = total;
+
+  std::cout << "  " << label << ": "
+            << inserting.count() / names.size() << " ns/insert, "
+            << finding.count() / (rounds * names.size()) << " ns/lookup"
+            << std::endl;
+}
+
+int main(int argc, char **argv) {
+  std::vector<size_t> counts = {8, 32, 128, 1024};
+  if (argc > 1)
+    counts = {size_t(std::stoul(argv[1]))};
+
+  for (auto count : counts) {
+    auto names = symbols(count);
+    std::cout << count << " symbols" << std::endl;
+
+    std::map<std::string, long> tree;
+    measure("std::map", names,
+            [&](const std::string &k, long v) { tree[k] = v; },
+            [&](const std::string &k) { return tree.find(k)->second; });
+
+    std::unordered_map<std::string, long> chained;
+    measure("std::unordered_map", names,
+            [&](const std::string &k, long v) { chained[k] = v; },
+            [&](const std::string &k) { return chained.find(k)->second; });
+
+    HashTable<long> table;
+    measure("HashTable", names,
+            [&](const std::string &k, long v) { table.insert(k, v); },
+            [&](const std::string &k) { return *table.find(k); });
+
+    std::vector<std::pair<std::string, long>> flat;
+    measure("linear scan", names,
+            [&](const std::string &k, long v) { flat.emplace_back(k, v); },
+            [&](const std::string &k) {
+              for (auto &it : flat) {
+                if (it.first == k)
+                  return it.second;
+              }
+              return 0L;
+            });
+  }
+  return 0;
+}
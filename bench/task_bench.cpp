@@ -0,0 +1,145 @@
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include "../src/interpreter.hpp"
+#include "../src/pool.hpp"
+
+// Two tasks hand a counter back and forth over a pair of channels; every
+// round trip is two task switches.
+static const char *pingPong = R"(
+var ping = channel();
+var pong = channel();
+fun player() {
+  var i = 0;
+  while (i < rounds) { send(pong, receive(ping) + 1); i = i + 1; }
+}
+fun driver() {
+  var i = 0;
+  var v = 0;
+  while (i < rounds) { send(ping, v); v = receive(pong); i = i + 1; }
+}
+spawn(player)
+spawn(driver)
+)";
+
+// Spawns every task up front and parks them all on a channel before any of
+// them does its work, so all of them are alive at the same time.
+static const char *fanOut = R"(
+var go = channel();
+var results = channel();
+fun worker(k) {
+  fun task() { receive(go); send(results, k * 2); }
+  return task;
+}
+var i = 0;
+while (i < tasks) { spawn(worker(i)); i = i + 1; }
+yield()
+i = 0;
+while (i < tasks) { send(go, nil); i = i + 1; }
+var sum = 0;
+i = 0;
+while (i < tasks) { sum = sum + receive(results); i = i + 1; }
+)";
+
+// Recursion inside a task runs on the task's own, much smaller stack.
+static const char *deepTask = R"(
+fun g(n) { if (n == 0) return 0; return g(n - 1) + 1; }
+fun t() { print g(depth); }
+spawn(t);
+)";
+
+using benchClock = std::chrono::steady_clock;
+
+static double seconds(benchClock::time_point since) {
+  return std::chrono::duration<double>(benchClock::now() - since).count();
+}
+
+int main(int argc, char **argv) {
+  int rounds = argc > 1 ? std::stoi(argv[1]) : 20000;
+  int tasks = argc > 2 ? std::stoi(argv[2]) : 10000;
+  int isolates = argc > 3 ? std::stoi(argv[3]) : 16;
+  int perIsolate = argc > 4 ? std::stoi(argv[4]) : 1000;
+
+  {
+    Program program("var rounds = " + std::to_string(rounds) + ";" + pingPong);
+    Evaluator eval;
+    auto start = benchClock::now();
+    eval.run(program);
+    double elapsed = seconds(start);
+    std::cout << "switch latency: " << elapsed / (2.0 * rounds) * 1e9
+              << " ns/switch (" << 2 * rounds << " switches)" << std::endl;
+  }
+
+  Program fanOutProgram("var tasks = " + std::to_string(tasks) + ";" + fanOut);
+  {
+    Evaluator eval;
+    auto start = benchClock::now();
+    eval.run(fanOutProgram);
+    double elapsed = seconds(start);
+    std::cout << "spawn throughput: " << tasks / elapsed << " tasks/s ("
+              << tasks << " live tasks)" << std::endl;
+  }
+
+  {
+    // M:N: many isolates, each with its own tasks, multiplexed over the
+    // pool. An isolate is rescheduled after every slice, which is where idle
+    // workers get the chance to steal it.
+    Program program("var tasks = " + std::to_string(perIsolate) + ";" +
+                    fanOut);
+    WorkStealingPool pool;
+    auto start = benchClock::now();
+    for (int i = 0; i < isolates; i++) {
+      auto eval = std::make_shared<Evaluator>();
+      eval->start(program);
+      pool.submit([eval]() mutable {
+        try {
+          if (eval->runSlice(256))
+            return true;
+        } catch (const ScriptError &e) {
+          std::cerr << e.message << std::endl;
+        }
+        eval = nullptr;
+        return false;
+      });
+    }
+    pool.wait();
+    double elapsed = seconds(start);
+    std::cout << "pool throughput: " << isolates * double(perIsolate) / elapsed
+              << " tasks/s (" << isolates << " isolates)" << std::endl;
+  }
+
+  // A task can recurse as deep as the budget lets the host (t and g(n) are
+  // n + 2 calls). Past that, or
+  // past the end of its stack when depth isn't limited, the task fails
+  // instead of the process.
+  struct {
+    int depth;
+    size_t limit;
+    bool fails;
+  } deep[] = {{Budget::DEFAULT_DEPTH - 2, Budget::DEFAULT_DEPTH, false},
+              {Budget::DEFAULT_DEPTH - 1, Budget::DEFAULT_DEPTH, true},
+              {1000000, 0, true}};
+  for (auto &test : deep) {
+    Program program("var depth = " + std::to_string(test.depth) + ";" +
+                    deepTask);
+    std::string printed;
+    Evaluator eval;
+    eval.setOutput(Output::string(printed), Output::Flush::FULL);
+    Budget budget;
+    budget.depth = test.limit;
+    eval.setBudget(budget);
+    bool failed = false;
+    try {
+      eval.run(program);
+    } catch (const ScriptError &e) {
+      failed = e.kind == ScriptError::STACK_LIMIT;
+    }
+    if (failed != test.fails) {
+      std::cout << "recursion to depth " << test.depth << " in a task "
+                << (failed ? "failed" : "didn't fail") << std::endl;
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -1,18 +1,37 @@
-#include <experimental/any>
+#include <cstring>
+#include <fstream>
 #include <iostream>
-#include <typeinfo>
+#include <sstream>
 #include <unistd.h>
 
 #include "src/ast.hpp"
 #include "src/parser.hpp"
+#include "src/program.hpp"
 #include "src/scanner.hpp"
 #include "src/interpreter.hpp"
+#include "src/lines.hpp"
+#include "src/stats.hpp"
+#include <optional>
 
-namespace stdx = std::experimental;
+// Runs f as the named phase when stats are being kept.
+template <typename F>
+auto phase(Stats *stats, const char *name, const Evaluator &eval, F f)
+    -> decltype(f()) {
+  if (stats == nullptr)
+    return f();
+  struct End {
+    Stats *stats;
+    const Evaluator &eval;
+    ~End() { stats->end(eval.heapTotals()); }
+  };
+  stats->begin(name, eval.heapTotals());
+  End end{stats, eval};
+  return f();
+}
 
-void runPrompt() {
+// Each line typed into the prompt is a run of its own, with a fresh budget.
+void runPrompt(Evaluator &eval, const Budget &budget, Stats *stats) {
   std::string line;
-  Evaluator eval;
   for (;;) {
     if (isatty(fileno(stdin)))
       std::cout << "> ";
@@ -20,31 +39,164 @@ void runPrompt() {
       break;
     auto scanner = Scanner(line);
     try {
-      auto tokens = scanner.scanTokens();
+      auto &tokens = phase(stats, "scan", eval, [&]() -> TokenStream & {
+        return scanner.scanTokens();
+      });
       auto parser = Parser(tokens);
-      auto stmt = parser.parseProgram();
-      auto ret = eval.run(stmt);
-      if (ret.type() == typeid(double)) {
-        double ans = stdx::any_cast<double>(ret);
-        std::cout << "< " << ans << std::endl;
+      auto stmt =
+          phase(stats, "parse", eval, [&] { return parser.parseProgram(); });
+      eval.setBudget(budget);
+      auto ret = phase(stats, "run", eval, [&] { return eval.run(stmt); });
+      if (isNumber(ret)) {
+        eval.flushOutput();
+        std::cout << "< " << asNumber(ret) << std::endl;
       }
+    } catch (const ScriptError &e) {
+      eval.flushOutput();
+      std::cerr << describe(e, line) << std::endl;
     } catch (const char *e) {
+      eval.flushOutput();
       std::cerr << e << std::endl;
-    } catch (stdx::bad_any_cast &e) {
-      // no return value
     }
   }
 }
 
-void runFile(std::string fname) {
-  std::cout << "file " << fname << " goes here" << std::endl;
+// Batch mode: once the script has run, its process function is called with
+// every line of standard input in turn.
+void processInput(Evaluator &eval) {
+  auto process = eval.function("process");
+  LineReader input(eval, STDIN_FILENO);
+  size_t records = 0;
+  auto start = std::chrono::steady_clock::now();
+  while (auto line = input.next()) {
+    Value arg = std::move(line);
+    eval.call(*process, &arg, 1);
+    records++;
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  eval.flushOutput();
+  std::cerr << records << " records in " << elapsed.count() << " s ("
+            << records / elapsed.count() << " records/s)" << std::endl;
 }
 
-int main(int argc, char **argv) {
-  if (argc < 2) {
-    runPrompt();
-  } else {
-    runFile(argv[1]);
+int runFile(Evaluator &eval, std::string fname, const Budget &budget,
+            bool stream, Stats *stats) {
+  std::ifstream file(fname);
+  if (!file) {
+    std::cerr << "Can't open " << fname << std::endl;
+    return 1;
+  }
+  std::stringstream source;
+  source << file.rdbuf();
+  try {
+    auto scanner = Scanner(source.str());
+    auto &tokens = phase(stats, "scan", eval, [&]() -> TokenStream & {
+      return scanner.scanTokens();
+    });
+    auto parser = Parser(tokens);
+    auto stmts =
+        phase(stats, "parse", eval, [&] { return parser.parseProgram(); });
+    eval.setBudget(budget);
+    phase(stats, "run", eval, [&] {
+      eval.run(stmts);
+      if (stream)
+        processInput(eval);
+    });
+  } catch (const ScriptError &e) {
+    eval.flushOutput();
+    std::cerr << fname << ":" << describe(e, source.str()) << std::endl;
+    return 1;
+  } catch (const char *e) {
+    eval.flushOutput();
+    std::cerr << e << std::endl;
+    return 1;
   }
   return 0;
 }
+
+static const char *usage =
+    "Usage: CppLox [--max-steps N] [--timeout MS] [--max-memory BYTES]\n"
+    "              [--max-depth CALLS] [--from-snapshot IMAGE]\n"
+    "              [--snapshot IMAGE] [--stats text|json]\n"
+    "              [script | -e script < input]";
+
+// --from-snapshot starts from the globals saved in an image instead of a
+// fresh environment; --snapshot saves the globals once the script (or the
+// prompt session) is over. -e runs the script over standard input. --stats
+// reports where the time went, per phase, on stderr.
+int main(int argc, char **argv) {
+  Budget budget;
+  const char *fromSnapshot = nullptr;
+  const char *snapshot = nullptr;
+  const char *script = nullptr;
+  bool stream = false;
+  const char *statsFormat = nullptr;
+  int arg = 1;
+  try {
+    for (; arg + 1 < argc && argv[arg][0] == '-'; arg += 2) {
+      auto option = argv[arg], value = argv[arg + 1];
+      if (strcmp(option, "--max-steps") == 0)
+        budget.steps = std::stoull(value);
+      else if (strcmp(option, "--timeout") == 0)
+        budget.time = std::chrono::milliseconds(std::stoull(value));
+      else if (strcmp(option, "--max-memory") == 0)
+        budget.memory = std::stoull(value);
+      else if (strcmp(option, "--max-depth") == 0)
+        budget.depth = std::stoull(value);
+      else if (strcmp(option, "--from-snapshot") == 0)
+        fromSnapshot = value;
+      else if (strcmp(option, "--snapshot") == 0)
+        snapshot = value;
+      else if (strcmp(option, "--stats") == 0 &&
+               (strcmp(value, "text") == 0 || strcmp(value, "json") == 0))
+        statsFormat = value;
+      else if (strcmp(option, "-e") == 0) {
+        script = value;
+        stream = true;
+      } else
+        throw std::invalid_argument(option);
+    }
+  } catch (const std::logic_error &) {
+    std::cerr << usage << std::endl;
+    return 1;
+  }
+  if (arg < argc && script == nullptr && argv[arg][0] != '-')
+    script = argv[arg++];
+  if (arg < argc) {
+    std::cerr << usage << std::endl;
+    return 1;
+  }
+  std::optional<Stats> stats;
+  if (statsFormat != nullptr)
+    stats.emplace();
+  Evaluator eval;
+  try {
+    if (fromSnapshot != nullptr)
+      eval.loadSnapshot(fromSnapshot);
+  } catch (const char *e) {
+    std::cerr << fromSnapshot << ": " << e << std::endl;
+    return 1;
+  }
+  int status = 0;
+  auto statsPtr = stats ? &*stats : nullptr;
+  if (script == nullptr)
+    runPrompt(eval, budget, statsPtr);
+  else
+    status = runFile(eval, script, budget, stream, statsPtr);
+  if (stats) {
+    eval.flushOutput();
+    if (strcmp(statsFormat, "json") == 0)
+      stats->writeJson(std::cerr);
+    else
+      stats->writeText(std::cerr);
+  }
+  try {
+    if (snapshot != nullptr && status == 0)
+      eval.saveSnapshot(snapshot);
+  } catch (const char *e) {
+    std::cerr << snapshot << ": " << e << std::endl;
+    return 1;
+  }
+  return status;
+}
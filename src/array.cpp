@@ -0,0 +1,324 @@
+#include "array.hpp"
+#include "interpreter.hpp"
+#include "pool.hpp"
+#include <cmath>
+#include <cstring>
+
+// Two doubles wide: SSE2 and NEON both guarantee that much, so this needs no
+// target flags.
+typedef double v2d __attribute__((vector_size(16)));
+
+// Elements per chunk handed to a pool thread. Anything smaller costs more to
+// hand off than it takes to compute.
+static constexpr size_t PARALLEL_GRAIN = 1 << 14;
+// Kernels run one instruction over a whole block of elements at a time, so
+// dispatch is paid per block rather than per element.
+static constexpr size_t BLOCK = 256;
+static constexpr size_t MAX_DEPTH = 16;
+
+static v2d load(const double *p) {
+  v2d v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+static void store(double *p, v2d v) { memcpy(p, &v, sizeof(v)); }
+
+// dst[i] = op(dst[i], src[i])
+template <typename F>
+static void lanes(double *dst, const double *src, size_t n, F op) {
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    store(dst + i, op(load(dst + i), load(src + i)));
+  }
+  for (; i < n; i++) {
+    dst[i] = op(dst[i], src[i]);
+  }
+}
+
+class KernelCompiler : ExprVisitor<KernelCompiler, bool> {
+  const Function &fn;
+  Kernel &kernel;
+  size_t sp;
+
+public:
+  KernelCompiler(const Function &fn, Kernel &kernel)
+      : fn(fn), kernel(kernel), sp(0) {}
+
+  bool compile(const Expr &expr) { return visit(expr); }
+
+private:
+  friend ExprVisitor<KernelCompiler, bool>;
+
+  bool push(Kernel::Op op, size_t param, double value) {
+    if (sp == MAX_DEPTH)
+      return false;
+    kernel.code.push_back({op, param, value});
+    kernel.depth = std::max(kernel.depth, ++sp);
+    return true;
+  }
+
+  bool visitBinop(const Binop &op) {
+    Kernel::Op code;
+    switch (op.op) {
+    case BinopType::ADD:
+      code = Kernel::Op::ADD;
+      break;
+    case BinopType::SUB:
+      code = Kernel::Op::SUB;
+      break;
+    case BinopType::MUL:
+      code = Kernel::Op::MUL;
+      break;
+    case BinopType::DIV:
+      code = Kernel::Op::DIV;
+      break;
+    default:
+      return false;
+    }
+    if (!visit(*op.lhs) || !visit(*op.rhs))
+      return false;
+    kernel.code.push_back({code, 0, 0});
+    sp--;
+    return true;
+  }
+  bool visitVariable(const Variable &v) {
+    auto &bindings = fn.decl->bindings;
+    for (size_t i = 0; i < bindings.size(); i++) {
+      if (bindings[i] == v.ident)
+        return push(Kernel::Op::PARAM, i, 0);
+    }
+    // Nothing can run while the kernel does, so a captured number is as
+    // good as a constant.
+    try {
+      auto &val = (*fn.closure)[v.ident];
+      return isNumber(val) && push(Kernel::Op::CONST, 0, asNumber(val));
+    } catch (const char *) {
+      return false;
+    }
+  }
+  bool visitLiteral(const Literal &lit) {
+    return isNumber(lit.value) &&
+           push(Kernel::Op::CONST, 0, asNumber(lit.value));
+  }
+  bool visitCall(const Call &) { return false; }
+  bool visitIndex(const Index &) { return false; }
+  bool visitUnop(const Unop &) { return false; }
+};
+
+bool Kernel::compile(const Function &fn, Kernel &out) {
+  auto &body = fn.decl->body;
+  if (body.size() != 1 || body[0]->kind != StmtKind::Return)
+    return false;
+  auto &ret = static_cast<const Return &>(*body[0]);
+  if (ret.value == nullptr)
+    return false;
+  out.arity = fn.decl->bindings.size();
+  out.code.clear();
+  out.depth = 0;
+  return KernelCompiler(fn, out).compile(*ret.value);
+}
+
+void Kernel::apply(const double *const *inputs, double *out, size_t n) const {
+  alignas(16) double stack[MAX_DEPTH][BLOCK];
+  for (size_t base = 0; base < n; base += BLOCK) {
+    size_t len = std::min(BLOCK, n - base);
+    size_t sp = 0;
+    for (auto &instr : code) {
+      switch (instr.op) {
+      case Op::PARAM:
+        memcpy(stack[sp++], inputs[instr.param] + base, len * sizeof(double));
+        break;
+      case Op::CONST:
+        std::fill_n(stack[sp++], len, instr.value);
+        break;
+      case Op::ADD:
+        sp--;
+        lanes(stack[sp - 1], stack[sp], len,
+              [](auto a, auto b) { return a + b; });
+        break;
+      case Op::SUB:
+        sp--;
+        lanes(stack[sp - 1], stack[sp], len,
+              [](auto a, auto b) { return a - b; });
+        break;
+      case Op::MUL:
+        sp--;
+        lanes(stack[sp - 1], stack[sp], len,
+              [](auto a, auto b) { return a * b; });
+        break;
+      case Op::DIV:
+        sp--;
+        lanes(stack[sp - 1], stack[sp], len,
+              [](auto a, auto b) { return a / b; });
+        break;
+      }
+    }
+    memcpy(out + base, stack[0], len * sizeof(double));
+  }
+}
+
+double Kernel::call(const double *args) const {
+  double stack[MAX_DEPTH];
+  size_t sp = 0;
+  for (auto &instr : code) {
+    switch (instr.op) {
+    case Op::PARAM:
+      stack[sp++] = args[instr.param];
+      break;
+    case Op::CONST:
+      stack[sp++] = instr.value;
+      break;
+    case Op::ADD:
+      sp--;
+      stack[sp - 1] += stack[sp];
+      break;
+    case Op::SUB:
+      sp--;
+      stack[sp - 1] -= stack[sp];
+      break;
+    case Op::MUL:
+      sp--;
+      stack[sp - 1] *= stack[sp];
+      break;
+    case Op::DIV:
+      sp--;
+      stack[sp - 1] /= stack[sp];
+      break;
+    }
+  }
+  return stack[0];
+}
+
+static double sumRange(const double *a, size_t n) {
+  v2d acc0 = {0, 0}, acc1 = {0, 0};
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    acc0 += load(a + i);
+    acc1 += load(a + i + 2);
+  }
+  acc0 += acc1;
+  double sum = acc0[0] + acc0[1];
+  for (; i < n; i++) {
+    sum += a[i];
+  }
+  return sum;
+}
+
+static double dotRange(const double *a, const double *b, size_t n) {
+  v2d acc0 = {0, 0}, acc1 = {0, 0};
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    acc0 += load(a + i) * load(b + i);
+    acc1 += load(a + i + 2) * load(b + i + 2);
+  }
+  acc0 += acc1;
+  double sum = acc0[0] + acc0[1];
+  for (; i < n; i++) {
+    sum += a[i] * b[i];
+  }
+  return sum;
+}
+
+// Sums partial(begin, end) over fixed chunks of [0, n). Chunk boundaries
+// don't depend on the number of threads, so neither does the result.
+template <typename F> static double reduceChunks(size_t n, F partial) {
+  size_t chunks = (n + PARALLEL_GRAIN - 1) / PARALLEL_GRAIN;
+  if (chunks <= 1)
+    return partial(0, n);
+  std::vector<double> partials(chunks);
+  parallelFor(n, PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+    partials[begin / PARALLEL_GRAIN] = partial(begin, end);
+  });
+  return sumRange(partials.data(), chunks);
+}
+
+static std::shared_ptr<Array> nativeArray(Evaluator &eval, double n) {
+  if (n < 0 || n != std::floor(n))
+    throw "Array size must be a non-negative integer";
+  if (n > double(Array::MAX_SIZE))
+    throw "Array too large";
+  return eval.array(size_t(n));
+}
+
+static std::shared_ptr<Array> nativeFill(std::shared_ptr<Array> a,
+                                         double val) {
+  auto data = a->data.data();
+  parallelFor(a->data.size(), PARALLEL_GRAIN,
+              [=](size_t begin, size_t end) {
+                std::fill(data + begin, data + end, val);
+              });
+  return a;
+}
+
+static double nativeSum(std::shared_ptr<Array> a) {
+  auto data = a->data.data();
+  return reduceChunks(a->data.size(), [=](size_t begin, size_t end) {
+    return sumRange(data + begin, end - begin);
+  });
+}
+
+static double nativeDot(std::shared_ptr<Array> a, std::shared_ptr<Array> b) {
+  if (a->data.size() != b->data.size())
+    throw "Arrays must have the same length";
+  auto lhs = a->data.data(), rhs = b->data.data();
+  return reduceChunks(a->data.size(), [=](size_t begin, size_t end) {
+    return dotRange(lhs + begin, rhs + begin, end - begin);
+  });
+}
+
+// Pure arithmetic functions run as kernels, split across the shared pool;
+// anything else is called element by element through the interpreter.
+static std::shared_ptr<Array> nativeMap(Evaluator &eval,
+                                        std::shared_ptr<Array> a,
+                                        std::shared_ptr<Function> fn) {
+  size_t n = a->data.size();
+  auto result = eval.array(n);
+  auto src = a->data.data();
+  auto dst = result->data.data();
+  Kernel kernel;
+  if (Kernel::compile(*fn, kernel) && kernel.arity == 1) {
+    parallelFor(n, PARALLEL_GRAIN, [&](size_t begin, size_t end) {
+      const double *in = src + begin;
+      kernel.apply(&in, dst + begin, end - begin);
+    });
+    return result;
+  }
+  for (size_t i = 0; i < n; i++) {
+    Value arg = src[i];
+    dst[i] = asNumber(eval.call(*fn, &arg, 1));
+  }
+  return result;
+}
+
+static Value nativeReduce(Evaluator &eval, std::shared_ptr<Array> a,
+                          std::shared_ptr<Function> fn, Value init) {
+  auto &data = a->data;
+  Kernel kernel;
+  if (isNumber(init) && Kernel::compile(*fn, kernel) && kernel.arity == 2) {
+    double args[2] = {asNumber(init), 0};
+    for (auto x : data) {
+      args[1] = x;
+      args[0] = kernel.call(args);
+    }
+    return args[0];
+  }
+  Value args[2] = {std::move(init), nullptr};
+  for (auto x : data) {
+    args[1] = x;
+    args[0] = eval.call(*fn, args, 2);
+  }
+  return args[0];
+}
+
+void Evaluator::defineArrayNatives() {
+  defineNative("array", nativeArray);
+  defineNative("fill", nativeFill);
+  defineNative("sum", nativeSum);
+  defineNative("dot", nativeDot);
+  defineNative("map", nativeMap);
+  defineNative("reduce", nativeReduce);
+}
+
+std::shared_ptr<Array> Evaluator::array(size_t n) {
+  return make<Array>(n, &heap);
+}
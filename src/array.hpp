@@ -0,0 +1,45 @@
+#pragma once
+#include "ast.hpp"
+#include "heap.hpp"
+#include <vector>
+
+struct Function;
+
+// Fixed-size, contiguous buffer of doubles. Elements are stored unboxed so
+// builtins can hand the buffer straight to SIMD kernels. The buffer lives in
+// the owning isolate's Heap, so it counts against that isolate's memory limit.
+struct Array {
+  // Larger sizes are refused before converting from a double: 32 GiB is more
+  // than one isolate should hold, and past SIZE_MAX the conversion is
+  // undefined.
+  static constexpr size_t MAX_SIZE = size_t(1) << 32;
+  std::vector<double, HeapAllocator<double>> data;
+  Array(size_t n, Heap *heap) : data(n, HeapAllocator<double>(heap)) {}
+};
+
+// A Lox function simple enough to run without the interpreter: its body is a
+// single return of arithmetic over its parameters, number literals and
+// numbers it closes over. Such a function can't have side effects, so it can
+// be applied to a whole array at once, in SIMD lanes and on several threads.
+class Kernel {
+public:
+  enum class Op { PARAM, CONST, ADD, SUB, MUL, DIV };
+  struct Instr {
+    Op op;
+    size_t param;
+    double value;
+  };
+
+  size_t arity;
+
+  // Returns false if fn doesn't have the required shape.
+  static bool compile(const Function &fn, Kernel &out);
+  // out[i] = f(inputs[0][i], inputs[1][i], ...) for every i < n.
+  void apply(const double *const *inputs, double *out, size_t n) const;
+  double call(const double *args) const;
+
+private:
+  friend class KernelCompiler;
+  std::vector<Instr> code;
+  size_t depth;
+};
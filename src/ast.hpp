@@ -1,10 +1,10 @@
 #pragma once
-#include <experimental/any>
 #include <iostream>
 #include <memory>
+#include <string>
 #include <vector>
 
-namespace stdx = std::experimental;
+#include "value.hpp"
 
 template <typename T> void write_maybe_null(std::ostream &os, T &o) {
   if (o != nullptr)
@@ -88,39 +88,49 @@ inline std::ostream &operator<<(std::ostream &os, const UnopType &node) {
   return os;
 }
 
-struct Binop;
-struct Variable;
-struct Call;
-struct Literal;
-struct Unop;
-class ExprVisitor {
+// Every node kind is listed exactly once here. The lists expand into the kind
+// tags, forward declarations and the switch in each visitor, so adding a node
+// means adding its struct below and one entry to the matching list.
+#define EXPR_NODES(X)                                                          \
+  X(Binop) X(Variable) X(Call) X(Index) X(Literal) X(Unop)
+#define STMT_NODES(X)                                                          \
+  X(ExpressionStmt)                                                            \
+  X(While) X(If) X(Fun) X(Return) X(Break) X(Continue) X(Print) X(Block)       \
+  X(VarDecl)
+
+#define AST_DECLARE(name) struct name;
+#define AST_KIND(name) name,
+EXPR_NODES(AST_DECLARE)
+STMT_NODES(AST_DECLARE)
+enum class ExprKind { EXPR_NODES(AST_KIND) };
+enum class StmtKind { STMT_NODES(AST_KIND) };
+#undef AST_KIND
+#undef AST_DECLARE
+
+struct Expr : Node {
+  const ExprKind kind;
+  // Source offset of the token the node was parsed from, for error messages.
+  size_t pos;
+
 protected:
-  virtual stdx::any visitBinop(Binop &) = 0;
-  virtual stdx::any visitVariable(Variable &) = 0;
-  virtual stdx::any visitCall(Call &) = 0;
-  virtual stdx::any visitLiteral(Literal &) = 0;
-  virtual stdx::any visitUnop(Unop &) = 0;
-  friend Binop;
-  friend Variable;
-  friend Call;
-  friend Literal;
-  friend Unop;
+  Expr(ExprKind kind) : kind(kind), pos(0) {}
 };
-struct Expr : Node {
-  virtual void write_to(std::ostream &) const = 0;
-  virtual stdx::any accept(ExprVisitor &) = 0;
+struct Stmt : Node {
+  const StmtKind kind;
+
+protected:
+  Stmt(StmtKind kind) : kind(kind) {}
 };
-inline std::ostream &operator<<(std::ostream &os, const Expr &node) {
-  node.write_to(os);
-  return os;
-}
+inline std::ostream &operator<<(std::ostream &os, const Expr &node);
+inline std::ostream &operator<<(std::ostream &os, const Stmt &node);
 
 struct Binop : Expr {
+  static constexpr ExprKind Kind = ExprKind::Binop;
   BinopType op;
   std::shared_ptr<Expr> lhs;
   std::shared_ptr<Expr> rhs;
   Binop(BinopType op, std::shared_ptr<Expr> lhs, std::shared_ptr<Expr> rhs)
-      : op(op), lhs(lhs), rhs(rhs) {}
+      : Expr(Kind), op(op), lhs(lhs), rhs(rhs) {}
   Binop(const Binop &other) = default;
   void write_to(std::ostream &os) const {
     os << "Binop("
@@ -132,29 +142,25 @@ struct Binop : Expr {
     write_maybe_null(os, this->rhs);
     os << ")";
   }
-
-  stdx::any accept(ExprVisitor &visitor) { return visitor.visitBinop(*this); }
 };
 
 struct Variable : Expr {
+  static constexpr ExprKind Kind = ExprKind::Variable;
   std::string ident;
-  Variable(std::string ident) : ident(ident) {}
+  Variable(std::string ident) : Expr(Kind), ident(ident) {}
   Variable(const Variable &other) = default;
   void write_to(std::ostream &os) const {
     os << "Variable("
        << "ident = " << this->ident << ")";
   }
-
-  stdx::any accept(ExprVisitor &visitor) {
-    return visitor.visitVariable(*this);
-  }
 };
 
 struct Call : Expr {
+  static constexpr ExprKind Kind = ExprKind::Call;
   std::shared_ptr<Expr> callee;
   std::vector<std::shared_ptr<Expr>> args;
   Call(std::shared_ptr<Expr> callee, std::vector<std::shared_ptr<Expr>> args)
-      : callee(callee), args(args) {}
+      : Expr(Kind), callee(callee), args(args) {}
   Call(const Call &other) = default;
   void write_to(std::ostream &os) const {
     os << "Call("
@@ -166,26 +172,43 @@ struct Call : Expr {
     os << "]"
        << ")";
   }
+};
 
-  stdx::any accept(ExprVisitor &visitor) { return visitor.visitCall(*this); }
+struct Index : Expr {
+  static constexpr ExprKind Kind = ExprKind::Index;
+  std::shared_ptr<Expr> object;
+  std::shared_ptr<Expr> index;
+  Index(std::shared_ptr<Expr> object, std::shared_ptr<Expr> index)
+      : Expr(Kind), object(object), index(index) {}
+  Index(const Index &other) = default;
+  void write_to(std::ostream &os) const {
+    os << "Index("
+       << "object = ";
+    write_maybe_null(os, this->object);
+    os << ", "
+       << "index = ";
+    write_maybe_null(os, this->index);
+    os << ")";
+  }
 };
 
 struct Literal : Expr {
-  double value;
-  Literal(double value) : value(value) {}
+  static constexpr ExprKind Kind = ExprKind::Literal;
+  Value value;
+  Literal(Value value) : Expr(Kind), value(value) {}
   Literal(const Literal &other) = default;
   void write_to(std::ostream &os) const {
     os << "Literal("
        << "value = " << this->value << ")";
   }
-
-  stdx::any accept(ExprVisitor &visitor) { return visitor.visitLiteral(*this); }
 };
 
 struct Unop : Expr {
+  static constexpr ExprKind Kind = ExprKind::Unop;
   UnopType op;
   std::shared_ptr<Expr> rhs;
-  Unop(UnopType op, std::shared_ptr<Expr> rhs) : op(op), rhs(rhs) {}
+  Unop(UnopType op, std::shared_ptr<Expr> rhs)
+      : Expr(Kind), op(op), rhs(rhs) {}
   Unop(const Unop &other) = default;
   void write_to(std::ostream &os) const {
     os << "Unop("
@@ -194,46 +217,12 @@ struct Unop : Expr {
     write_maybe_null(os, this->rhs);
     os << ")";
   }
-
-  stdx::any accept(ExprVisitor &visitor) { return visitor.visitUnop(*this); }
 };
 
-struct ExpressionStmt;
-struct While;
-struct If;
-struct Fun;
-struct Print;
-struct Block;
-struct VarDecl;
-class StmtVisitor {
-protected:
-  virtual stdx::any visitExpressionStmt(ExpressionStmt &) = 0;
-  virtual stdx::any visitWhile(While &) = 0;
-  virtual stdx::any visitIf(If &) = 0;
-  virtual stdx::any visitFun(Fun &) = 0;
-  virtual stdx::any visitPrint(Print &) = 0;
-  virtual stdx::any visitBlock(Block &) = 0;
-  virtual stdx::any visitVarDecl(VarDecl &) = 0;
-  friend ExpressionStmt;
-  friend While;
-  friend If;
-  friend Fun;
-  friend Print;
-  friend Block;
-  friend VarDecl;
-};
-struct Stmt : Node {
-  virtual void write_to(std::ostream &) const = 0;
-  virtual stdx::any accept(StmtVisitor &) = 0;
-};
-inline std::ostream &operator<<(std::ostream &os, const Stmt &node) {
-  node.write_to(os);
-  return os;
-}
-
 struct ExpressionStmt : Stmt {
+  static constexpr StmtKind Kind = StmtKind::ExpressionStmt;
   std::shared_ptr<Expr> expr;
-  ExpressionStmt(std::shared_ptr<Expr> expr) : expr(expr) {}
+  ExpressionStmt(std::shared_ptr<Expr> expr) : Stmt(Kind), expr(expr) {}
   ExpressionStmt(const ExpressionStmt &other) = default;
   void write_to(std::ostream &os) const {
     os << "ExpressionStmt("
@@ -241,17 +230,14 @@ struct ExpressionStmt : Stmt {
     write_maybe_null(os, this->expr);
     os << ")";
   }
-
-  stdx::any accept(StmtVisitor &visitor) {
-    return visitor.visitExpressionStmt(*this);
-  }
 };
 
 struct While : Stmt {
+  static constexpr StmtKind Kind = StmtKind::While;
   std::shared_ptr<Expr> cond;
   std::shared_ptr<Stmt> body;
   While(std::shared_ptr<Expr> cond, std::shared_ptr<Stmt> body)
-      : cond(cond), body(body) {}
+      : Stmt(Kind), cond(cond), body(body) {}
   While(const While &other) = default;
   void write_to(std::ostream &os) const {
     os << "While("
@@ -262,17 +248,16 @@ struct While : Stmt {
     write_maybe_null(os, this->body);
     os << ")";
   }
-
-  stdx::any accept(StmtVisitor &visitor) { return visitor.visitWhile(*this); }
 };
 
 struct If : Stmt {
+  static constexpr StmtKind Kind = StmtKind::If;
   std::shared_ptr<Expr> cond;
   std::shared_ptr<Stmt> ifTrue;
   std::shared_ptr<Stmt> ifFalse;
   If(std::shared_ptr<Expr> cond, std::shared_ptr<Stmt> ifTrue,
      std::shared_ptr<Stmt> ifFalse)
-      : cond(cond), ifTrue(ifTrue), ifFalse(ifFalse) {}
+      : Stmt(Kind), cond(cond), ifTrue(ifTrue), ifFalse(ifFalse) {}
   If(const If &other) = default;
   void write_to(std::ostream &os) const {
     os << "If("
@@ -286,17 +271,18 @@ struct If : Stmt {
     write_maybe_null(os, this->ifFalse);
     os << ")";
   }
-
-  stdx::any accept(StmtVisitor &visitor) { return visitor.visitIf(*this); }
 };
 
-struct Fun : Stmt {
+// Function values keep their declaration alive after the program that
+// defined it is gone, hence shared_from_this.
+struct Fun : Stmt, std::enable_shared_from_this<Fun> {
+  static constexpr StmtKind Kind = StmtKind::Fun;
   std::string name;
   std::vector<std::string> bindings;
   std::vector<std::shared_ptr<Stmt>> body;
   Fun(std::string name, std::vector<std::string> bindings,
       std::vector<std::shared_ptr<Stmt>> body)
-      : name(name), bindings(bindings), body(body) {}
+      : Stmt(Kind), name(name), bindings(bindings), body(body) {}
   Fun(const Fun &other) = default;
   void write_to(std::ostream &os) const {
     os << "Fun("
@@ -310,13 +296,39 @@ struct Fun : Stmt {
     os << "]"
        << ")";
   }
+};
+
+struct Return : Stmt {
+  static constexpr StmtKind Kind = StmtKind::Return;
+  std::shared_ptr<Expr> value;
+  Return(std::shared_ptr<Expr> value) : Stmt(Kind), value(value) {}
+  Return(const Return &other) = default;
+  void write_to(std::ostream &os) const {
+    os << "Return("
+       << "value = ";
+    write_maybe_null(os, this->value);
+    os << ")";
+  }
+};
 
-  stdx::any accept(StmtVisitor &visitor) { return visitor.visitFun(*this); }
+struct Break : Stmt {
+  static constexpr StmtKind Kind = StmtKind::Break;
+  Break() : Stmt(Kind) {}
+  Break(const Break &other) = default;
+  void write_to(std::ostream &os) const { os << "Break()"; }
+};
+
+struct Continue : Stmt {
+  static constexpr StmtKind Kind = StmtKind::Continue;
+  Continue() : Stmt(Kind) {}
+  Continue(const Continue &other) = default;
+  void write_to(std::ostream &os) const { os << "Continue()"; }
 };
 
 struct Print : Stmt {
+  static constexpr StmtKind Kind = StmtKind::Print;
   std::shared_ptr<Expr> expr;
-  Print(std::shared_ptr<Expr> expr) : expr(expr) {}
+  Print(std::shared_ptr<Expr> expr) : Stmt(Kind), expr(expr) {}
   Print(const Print &other) = default;
   void write_to(std::ostream &os) const {
     os << "Print("
@@ -324,13 +336,13 @@ struct Print : Stmt {
     write_maybe_null(os, this->expr);
     os << ")";
   }
-
-  stdx::any accept(StmtVisitor &visitor) { return visitor.visitPrint(*this); }
 };
 
 struct Block : Stmt {
+  static constexpr StmtKind Kind = StmtKind::Block;
   std::vector<std::shared_ptr<Stmt>> stmts;
-  Block(std::vector<std::shared_ptr<Stmt>> stmts) : stmts(stmts) {}
+  Block(std::vector<std::shared_ptr<Stmt>> stmts)
+      : Stmt(Kind), stmts(stmts) {}
   Block(const Block &other) = default;
   void write_to(std::ostream &os) const {
     os << "Block("
@@ -339,15 +351,14 @@ struct Block : Stmt {
     os << "]"
        << ")";
   }
-
-  stdx::any accept(StmtVisitor &visitor) { return visitor.visitBlock(*this); }
 };
 
 struct VarDecl : Stmt {
+  static constexpr StmtKind Kind = StmtKind::VarDecl;
   std::string ident;
   std::shared_ptr<Expr> init;
   VarDecl(std::string ident, std::shared_ptr<Expr> init)
-      : ident(ident), init(init) {}
+      : Stmt(Kind), ident(ident), init(init) {}
   VarDecl(const VarDecl &other) = default;
   void write_to(std::ostream &os) const {
     os << "VarDecl("
@@ -356,6 +367,61 @@ struct VarDecl : Stmt {
     write_maybe_null(os, this->init);
     os << ")";
   }
+};
 
-  stdx::any accept(StmtVisitor &visitor) { return visitor.visitVarDecl(*this); }
+// Visitors are CRTP bases: visit() switches on the node's kind tag and calls
+// Derived::visitX directly, so there is no virtual call and the handlers can
+// be inlined. R is whatever the pass produces; nothing is boxed.
+template <typename Derived, typename R> class ExprVisitor {
+public:
+  R visit(const Expr &node) {
+    auto &self = static_cast<Derived &>(*this);
+    switch (node.kind) {
+#define AST_DISPATCH(name)                                                     \
+  case ExprKind::name:                                                         \
+    return self.visit##name(static_cast<const name &>(node));
+      EXPR_NODES(AST_DISPATCH)
+#undef AST_DISPATCH
+    }
+    __builtin_unreachable();
+  }
 };
+
+template <typename Derived, typename R> class StmtVisitor {
+public:
+  R visit(const Stmt &node) {
+    auto &self = static_cast<Derived &>(*this);
+    switch (node.kind) {
+#define AST_DISPATCH(name)                                                     \
+  case StmtKind::name:                                                         \
+    return self.visit##name(static_cast<const name &>(node));
+      STMT_NODES(AST_DISPATCH)
+#undef AST_DISPATCH
+    }
+    __builtin_unreachable();
+  }
+};
+
+inline std::ostream &operator<<(std::ostream &os, const Expr &node) {
+  switch (node.kind) {
+#define AST_WRITE(name)                                                        \
+  case ExprKind::name:                                                         \
+    static_cast<const name &>(node).write_to(os);                              \
+    break;
+    EXPR_NODES(AST_WRITE)
+#undef AST_WRITE
+  }
+  return os;
+}
+
+inline std::ostream &operator<<(std::ostream &os, const Stmt &node) {
+  switch (node.kind) {
+#define AST_WRITE(name)                                                        \
+  case StmtKind::name:                                                         \
+    static_cast<const name &>(node).write_to(os);                              \
+    break;
+    STMT_NODES(AST_WRITE)
+#undef AST_WRITE
+  }
+  return os;
+}
@@ -0,0 +1,163 @@
+#include "interpreter.hpp"
+#include <unordered_map>
+
+// A function declared in a call frame refers back to the frame, which
+// refers to the function, so once a closure has escaped its call, reference
+// counting alone never frees either. Cycles are found by trial deletion:
+// among everything reachable from the suspect frames, an object whose count
+// is all references from the others is only kept alive by them, unless it
+// can be reached from one that something outside holds.
+//
+// Lists and dicts are only looked into while none of their nodes is shared,
+// so that each reference followed is one their use counts account for.
+// Otherwise, and for transients, they count as held from outside.
+namespace {
+class CycleFinder {
+  enum class Kind : uint8_t { SCOPE, FUNCTION, LIST, DICT };
+  struct Object {
+    std::shared_ptr<void> ptr;
+    Kind kind;
+    bool live;
+    // References from outside the graph, once it has been scanned.
+    long refs;
+    std::vector<size_t> edges;
+  };
+  std::vector<Object> objects;
+  std::unordered_map<const void *, size_t> index;
+
+  template <typename T> T &as(size_t i) {
+    return *static_cast<T *>(objects[i].ptr.get());
+  }
+
+  void edge(size_t from, std::shared_ptr<void> ptr, Kind kind) {
+    auto to = add(std::move(ptr), kind);
+    objects[to].refs--;
+    objects[from].edges.push_back(to);
+  }
+  void edge(size_t from, const Value &val) {
+    if (auto fn = std::get_if<std::shared_ptr<Function>>(&val))
+      edge(from, *fn, Kind::FUNCTION);
+    else if (auto list = std::get_if<std::shared_ptr<List>>(&val))
+      edge(from, *list, Kind::LIST);
+    else if (auto dict = std::get_if<std::shared_ptr<Dict>>(&val))
+      edge(from, *dict, Kind::DICT);
+  }
+
+  void scan(size_t i) {
+    switch (objects[i].kind) {
+    case Kind::SCOPE: {
+      auto &scope = as<Scope<Value>>(i);
+      if (scope.outer() != nullptr)
+        edge(i, scope.outer(), Kind::SCOPE);
+      scope.forEach(
+          [this, i](std::string_view, const Value &val) { edge(i, val); });
+      break;
+    }
+    case Kind::FUNCTION: {
+      auto &fn = as<Function>(i);
+      if (fn.closure != nullptr)
+        edge(i, fn.closure, Kind::SCOPE);
+      break;
+    }
+    case Kind::LIST: {
+      auto &list = as<List>(i);
+      if (list.builder || !list.items.unshared())
+        break;
+      for (size_t j = 0; j < list.items.size(); j++) {
+        edge(i, list.items[j]);
+      }
+      break;
+    }
+    case Kind::DICT: {
+      auto &dict = as<Dict>(i);
+      if (dict.builder || !dict.items.unshared())
+        break;
+      dict.items.forEach([this, i](const Value &key, const Value &val) {
+        edge(i, key);
+        edge(i, val);
+      });
+      break;
+    }
+    }
+  }
+
+  void clear(size_t i) {
+    switch (objects[i].kind) {
+    case Kind::SCOPE:
+      as<Scope<Value>>(i).reset(nullptr);
+      break;
+    case Kind::FUNCTION:
+      as<Function>(i).closure = nullptr;
+      break;
+    case Kind::LIST:
+      as<List>(i).items = PVector();
+      break;
+    case Kind::DICT:
+      as<Dict>(i).items = PMap();
+      break;
+    }
+  }
+
+public:
+  // Takes ptr, which mustn't be a copy anyone else goes on holding.
+  size_t add(std::shared_ptr<void> ptr, Kind kind) {
+    auto found = index.emplace(ptr.get(), objects.size());
+    if (found.second) {
+      long refs = ptr.use_count() - 1;
+      objects.push_back({std::move(ptr), kind, false, refs, {}});
+    }
+    return found.first->second;
+  }
+  size_t add(std::shared_ptr<Scope<Value>> scope) {
+    return add(std::move(scope), Kind::SCOPE);
+  }
+
+  // Frees whatever only cycles among the objects added so far, and the ones
+  // they reach, keep alive.
+  void collect() {
+    for (size_t i = 0; i < objects.size(); i++) {
+      scan(i);
+    }
+    std::vector<size_t> stack;
+    for (size_t i = 0; i < objects.size(); i++) {
+      if (objects[i].refs > 0 && !objects[i].live) {
+        objects[i].live = true;
+        stack.push_back(i);
+      }
+      while (!stack.empty()) {
+        auto j = stack.back();
+        stack.pop_back();
+        for (auto k : objects[j].edges) {
+          if (!objects[k].live) {
+            objects[k].live = true;
+            stack.push_back(k);
+          }
+        }
+      }
+    }
+    for (size_t i = 0; i < objects.size(); i++) {
+      if (!objects[i].live)
+        clear(i);
+    }
+  }
+};
+} // namespace
+
+void Evaluator::collectCycles() {
+  {
+    CycleFinder finder;
+    for (auto &suspect : suspects) {
+      if (auto frame = suspect.lock())
+        finder.add(std::move(frame));
+    }
+    finder.collect();
+  }
+  suspects.erase(std::remove_if(suspects.begin(), suspects.end(),
+                                [](const std::weak_ptr<Scope<Value>> &frame) {
+                                  return frame.expired();
+                                }),
+                 suspects.end());
+  // Frames that survived are looked at again, but only once as many new ones
+  // have come along, so each costs a bounded amount of scanning.
+  collectAt = std::max(MIN_COLLECT_AT, 2 * suspects.size());
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// A fault in a script, raised by the scanner, the parser or at run time. pos
+// is the byte offset into the source of the token it was raised at.
+//
+// A run that used up its budget fails with one of the limit kinds instead of
+// FAULT, so a host can tell a runaway script from a broken one.
+struct ScriptError {
+  static constexpr size_t NO_POSITION = SIZE_MAX;
+  enum Kind : uint8_t {
+    FAULT,
+    STEP_LIMIT,
+    DEADLINE,
+    MEMORY_LIMIT,
+    STACK_LIMIT
+  };
+  const char *message;
+  size_t pos;
+  Kind kind = FAULT;
+};
+
+// "line:column: message", counting both from 1.
+inline std::string describe(const ScriptError &error,
+                            std::string_view source) {
+  if (error.pos == ScriptError::NO_POSITION || error.pos > source.size())
+    return error.message;
+  size_t line = 1, column = 1;
+  for (size_t i = 0; i < error.pos; i++) {
+    if (source[i] == '\n') {
+      line += 1;
+      column = 1;
+    } else {
+      column += 1;
+    }
+  }
+  return std::to_string(line) + ":" + std::to_string(column) + ": " +
+         error.message;
+}
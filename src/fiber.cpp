@@ -0,0 +1,92 @@
+#include "fiber.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <new>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+// Finished fibers hand their stacks back here so spawning many short tasks
+// doesn't turn into an mmap/munmap per task.
+static thread_local std::vector<void *> stackCache;
+static constexpr size_t STACK_CACHE_LIMIT = 64;
+// A cached stack keeps this much of what it used committed; anything deeper
+// goes back to the kernel first.
+static constexpr size_t STACK_KEEP = 256 * 1024;
+
+static void *mapStack() {
+  if (!stackCache.empty()) {
+    auto stack = stackCache.back();
+    stackCache.pop_back();
+    return stack;
+  }
+  auto page = size_t(sysconf(_SC_PAGESIZE));
+  auto mem = mmap(nullptr, Fiber::STACK_SIZE + page, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1,
+                  0);
+  if (mem == MAP_FAILED)
+    throw std::bad_alloc();
+  // Guard page, so running off the end of the stack faults instead of
+  // silently corrupting whatever is mapped below.
+  mprotect(mem, page, PROT_NONE);
+  return static_cast<char *>(mem) + page;
+}
+
+static void unmapStack(void *stack, size_t lowWater) {
+  if (stackCache.size() < STACK_CACHE_LIMIT) {
+    if (Fiber::STACK_SIZE - lowWater > STACK_KEEP)
+      madvise(stack, Fiber::STACK_SIZE - STACK_KEEP, MADV_DONTNEED);
+    stackCache.push_back(stack);
+    return;
+  }
+  auto page = size_t(sysconf(_SC_PAGESIZE));
+  munmap(static_cast<char *>(stack) - page, Fiber::STACK_SIZE + page);
+}
+
+Fiber::Fiber(std::function<void()> entry)
+    : stack(nullptr), entry(std::move(entry)), started(false),
+      finished(false), lowWater(STACK_SIZE) {}
+
+Fiber::~Fiber() {
+  if (stack != nullptr)
+    unmapStack(stack, lowWater);
+}
+
+// makecontext only passes ints, so the Fiber pointer arrives in two halves.
+void Fiber::trampoline(unsigned lo, unsigned hi) {
+  auto fiber = reinterpret_cast<Fiber *>(uintptr_t(hi) << 32 | uintptr_t(lo));
+  fiber->entry();
+  fiber->finished = true;
+  setcontext(&fiber->caller);
+}
+
+void Fiber::resume() {
+  if (finished)
+    return;
+  if (!started) {
+    stack = mapStack();
+    getcontext(&context);
+    context.uc_stack.ss_sp = stack;
+    context.uc_stack.ss_size = STACK_SIZE;
+    context.uc_link = nullptr;
+    auto self = uintptr_t(this);
+    makecontext(&context, reinterpret_cast<void (*)()>(trampoline), 2,
+                unsigned(self), unsigned(self >> 32));
+    started = true;
+  }
+  swapcontext(&caller, &context);
+  if (finished) {
+    unmapStack(stack, lowWater);
+    stack = nullptr;
+  }
+}
+
+void Fiber::suspend() { swapcontext(&context, &caller); }
+
+size_t Fiber::stackLeft() {
+  // Stacks grow down, towards the start of the mapping.
+  size_t left = static_cast<char *>(__builtin_frame_address(0)) -
+                static_cast<char *>(stack);
+  lowWater = std::min(lowWater, left);
+  return left;
+}
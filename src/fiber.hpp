@@ -0,0 +1,39 @@
+#pragma once
+#include <cstddef>
+#include <functional>
+#include <ucontext.h>
+
+// A coroutine with its own machine stack. resume() runs it until it calls
+// suspend() or its entry function returns. Control always goes back to
+// whoever resumed the fiber, never sideways to another fiber.
+//
+// Stacks are mapped lazily on first resume, so a fiber that has been created
+// but not started costs only this object. They are as big as a thread's, so
+// a task can recurse as deep as the host, but only the pages a fiber has
+// actually used are committed.
+class Fiber {
+  ucontext_t context;
+  ucontext_t caller;
+  void *stack;
+  std::function<void()> entry;
+  bool started;
+  bool finished;
+  // The least stackLeft() has returned.
+  size_t lowWater;
+
+  static void trampoline(unsigned lo, unsigned hi);
+
+public:
+  static constexpr size_t STACK_SIZE = 8 * 1024 * 1024;
+
+  Fiber(std::function<void()> entry);
+  Fiber(const Fiber &) = delete;
+  Fiber &operator=(const Fiber &) = delete;
+  ~Fiber();
+
+  void resume();
+  void suspend();
+  bool done() const { return finished; }
+  // Bytes of stack left below the caller. Only meaningful on the fiber.
+  size_t stackLeft();
+};
@@ -0,0 +1,59 @@
+#include "heap.hpp"
+#include <cstdlib>
+#include <new>
+
+// Large blocks and chunks come straight from malloc rather than operator
+// new: the heap already counts every block it hands out in its totals, and
+// --stats counts calls to operator new as well.
+static void *systemAllocate(size_t size) {
+  if (auto ptr = std::malloc(size))
+    return ptr;
+  throw std::bad_alloc();
+}
+
+Heap::Heap()
+    : freeLists{}, bump(nullptr), bumpEnd(nullptr), inUse(0),
+      limit(SIZE_MAX), allocations(0), bytesAllocated(0),
+      shared(std::make_shared<SharedAccount>()) {}
+
+Heap::~Heap() {
+  for (auto chunk : chunks) {
+    std::free(chunk);
+  }
+}
+
+void *Heap::allocate(size_t size) {
+  size = size == 0 ? GRANULE : (size + GRANULE - 1) & ~(GRANULE - 1);
+  reserve(size);
+  allocations += 1;
+  bytesAllocated += size;
+  if (size > SMALL_LIMIT)
+    return systemAllocate(size);
+  auto &list = freeLists[size / GRANULE - 1];
+  if (list != nullptr) {
+    auto block = list;
+    list = block->next;
+    return block;
+  }
+  if (size_t(bumpEnd - bump) < size) {
+    bump = static_cast<char *>(systemAllocate(CHUNK_SIZE));
+    bumpEnd = bump + CHUNK_SIZE;
+    chunks.push_back(bump);
+  }
+  auto block = bump;
+  bump += size;
+  return block;
+}
+
+void Heap::deallocate(void *ptr, size_t size) {
+  size = size == 0 ? GRANULE : (size + GRANULE - 1) & ~(GRANULE - 1);
+  inUse -= size;
+  if (size > SMALL_LIMIT) {
+    std::free(ptr);
+    return;
+  }
+  auto &list = freeLists[size / GRANULE - 1];
+  auto block = static_cast<FreeBlock *>(ptr);
+  block->next = list;
+  list = block;
+}
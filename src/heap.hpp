@@ -0,0 +1,146 @@
+#pragma once
+#include "error.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Memory an isolate's values own outside its Heap, in blocks other threads
+// may end up freeing. The count is atomic, and every such block keeps the
+// account alive, so it can be credited from any thread, even once the
+// isolate is gone.
+struct SharedAccount {
+  std::atomic<size_t> bytes{0};
+  std::atomic<size_t> limit{SIZE_MAX};
+};
+
+// Allocator private to one Evaluator. Isolates on different threads never
+// touch the same free lists, so they don't contend on a shared malloc, and
+// each isolate's footprint is known exactly.
+//
+// Small blocks come from per-size free lists carved out of 64 KiB chunks;
+// anything bigger goes to malloc. Everything is released when the Heap
+// is destroyed, so no value allocated from it may outlive its Evaluator.
+//
+// With a limit set, any allocation that would take the bytes in use past it
+// throws a MEMORY_LIMIT ScriptError instead. The isolate's SharedAccount
+// counts towards the bytes in use.
+class Heap {
+  static constexpr size_t GRANULE = 16;
+  static constexpr size_t SMALL_LIMIT = 512;
+  static constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+  struct FreeBlock {
+    FreeBlock *next;
+  };
+  FreeBlock *freeLists[SMALL_LIMIT / GRANULE];
+  std::vector<void *> chunks;
+  char *bump;
+  char *bumpEnd;
+  size_t inUse;
+  size_t limit;
+  uint64_t allocations;
+  uint64_t bytesAllocated;
+  std::shared_ptr<SharedAccount> shared;
+
+  void reserve(size_t size) {
+    auto total = inUse + shared->bytes.load(std::memory_order_relaxed);
+    if (size > limit || total > limit - size)
+      throw ScriptError{"Memory limit exceeded", ScriptError::NO_POSITION,
+                        ScriptError::MEMORY_LIMIT};
+    inUse += size;
+  }
+
+public:
+  Heap();
+  Heap(const Heap &) = delete;
+  Heap &operator=(const Heap &) = delete;
+  ~Heap();
+
+  void *allocate(size_t size);
+  void deallocate(void *ptr, size_t size);
+  size_t bytesInUse() const {
+    return inUse + shared->bytes.load(std::memory_order_relaxed);
+  }
+  // Running totals since the heap was made, counting every allocation at
+  // its rounded-up size.
+  struct Totals {
+    uint64_t allocations;
+    uint64_t bytes;
+  };
+  Totals totals() const { return {allocations, bytesAllocated}; }
+  void setLimit(size_t bytes) {
+    limit = bytes;
+    shared->limit = bytes;
+  }
+  const std::shared_ptr<SharedAccount> &account() const { return shared; }
+
+  // Memory a heap object owns but got from elsewhere, like a long string's
+  // characters, still counts against the limit.
+  void charge(size_t size) { reserve(size); }
+  void credit(size_t size) { inUse -= size; }
+};
+
+template <typename T> class HeapAllocator {
+public:
+  typedef T value_type;
+  Heap *heap;
+
+  HeapAllocator(Heap *heap) : heap(heap) {}
+  template <typename U>
+  HeapAllocator(const HeapAllocator<U> &other) : heap(other.heap) {}
+
+  T *allocate(size_t n) {
+    return static_cast<T *>(heap->allocate(n * sizeof(T)));
+  }
+  void deallocate(T *ptr, size_t n) { heap->deallocate(ptr, n * sizeof(T)); }
+
+  template <typename U> bool operator==(const HeapAllocator<U> &other) const {
+    return heap == other.heap;
+  }
+  template <typename U> bool operator!=(const HeapAllocator<U> &other) const {
+    return heap != other.heap;
+  }
+};
+
+// Allocates from operator new and charges a SharedAccount, checking only
+// the account's own bytes against the limit; the isolate's next Heap
+// allocation counts the rest. A null account charges nobody.
+template <typename T> class SharedAllocator {
+public:
+  typedef T value_type;
+  std::shared_ptr<SharedAccount> account;
+
+  SharedAllocator(std::shared_ptr<SharedAccount> account)
+      : account(std::move(account)) {}
+  template <typename U>
+  SharedAllocator(const SharedAllocator<U> &other) : account(other.account) {}
+
+  T *allocate(size_t n) {
+    size_t size = n * sizeof(T);
+    if (account != nullptr) {
+      auto before = account->bytes.fetch_add(size, std::memory_order_relaxed);
+      if (before + size > account->limit.load(std::memory_order_relaxed)) {
+        account->bytes.fetch_sub(size, std::memory_order_relaxed);
+        throw ScriptError{"Memory limit exceeded", ScriptError::NO_POSITION,
+                          ScriptError::MEMORY_LIMIT};
+      }
+    }
+    return static_cast<T *>(::operator new(size));
+  }
+  void deallocate(T *ptr, size_t n) {
+    if (account != nullptr)
+      account->bytes.fetch_sub(n * sizeof(T), std::memory_order_relaxed);
+    ::operator delete(ptr);
+  }
+
+  template <typename U>
+  bool operator==(const SharedAllocator<U> &other) const {
+    return account == other.account;
+  }
+  template <typename U>
+  bool operator!=(const SharedAllocator<U> &other) const {
+    return account != other.account;
+  }
+};
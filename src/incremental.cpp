@@ -0,0 +1,189 @@
+#include "incremental.hpp"
+#include "error.hpp"
+#include "scanner.hpp"
+#include <algorithm>
+
+// The scanner decides where a token ends by looking at most this far past it,
+// as in "1." or "/".
+static constexpr size_t LOOKAHEAD = 2;
+
+// Replaces elements [from, to) of column with those of with, moving what
+// follows only once.
+template <typename T>
+static void replace(std::vector<T> &column, size_t from, size_t to,
+                    const std::vector<T> &with) {
+  auto count = to - from;
+  if (with.size() > count)
+    column.insert(column.begin() + to, with.size() - count, T());
+  else
+    column.erase(column.begin() + from + with.size(), column.begin() + to);
+  std::copy(with.begin(), with.end(), column.begin() + from);
+}
+
+// Replaces tokens [from, to) with segment's, whose offsets are already right,
+// and moves the tokens after them along by bytes.
+static void splice(TokenStream &tokens, size_t from, size_t to,
+                   const TokenStream &segment, int64_t bytes) {
+  replace(tokens.types, from, to, segment.types);
+  replace(tokens.offsets, from, to, segment.offsets);
+  replace(tokens.lengths, from, to, segment.lengths);
+  if (bytes != 0) {
+    for (auto i = from + segment.size(); i < tokens.size(); i++) {
+      tokens.offsets[i] += bytes;
+    }
+  }
+}
+
+IncrementalProgram::IncrementalProgram(std::string source)
+    : text(source), prefix(source.size()), suffix(source.size()),
+      pending(false) {
+  auto scanner = Scanner(std::move(source));
+  tokens = std::move(scanner.scanTokens());
+  auto parser = Parser(tokens, 0, 0, nullptr, &parsed);
+  while (tokens.types[parser.next()] != TokenType::T_EOF) {
+    starts.push_back(parser.next());
+    stmts.push_back(parser.parseStatement());
+  }
+  starts.push_back(parser.next());
+}
+
+void IncrementalProgram::edit(size_t offset, size_t deleted,
+                              std::string_view inserted) {
+  if (offset > text.size() || deleted > text.size() - offset)
+    throw "Edit out of range";
+  // Nothing to do unless earlier edits still need parsing.
+  if (deleted == 0 && inserted.empty() && !pending)
+    return;
+  prefix = std::min(prefix, offset);
+  suffix = std::min(suffix, text.size() - offset - deleted);
+  text.replace(offset, deleted, inserted);
+  pending = true;
+  update();
+  pending = false;
+  prefix = suffix = text.size();
+}
+
+void IncrementalProgram::update() {
+  auto &old = tokens.source;
+  auto oldEnd = old.size() - suffix, newEnd = text.size() - suffix;
+  int64_t bytes = int64_t(newEnd) - int64_t(oldEnd);
+
+  // Scan from the first token that ends close enough to the changed bytes to
+  // have been decided by them (T_EOF always qualifies), until a token starts
+  // after them where one started before. From there on the tokens are the
+  // same.
+  size_t from = 0, last = tokens.size() - 1;
+  while (from < last) {
+    auto mid = (from + last) / 2;
+    if (tokens.offsets[mid] + tokens.lengths[mid] + LOOKAHEAD > prefix)
+      last = mid;
+    else
+      from = mid + 1;
+  }
+  auto start =
+      from == 0 ? 0 : tokens.offsets[from - 1] + tokens.lengths[from - 1];
+  auto scanner = Scanner(text, start);
+  auto &fresh = scanner.scanned();
+  auto to = from;
+  for (;;) {
+    scanner.next();
+    int64_t at = fresh.offsets.back();
+    if (at < int64_t(newEnd))
+      continue;
+    while (tokens.offsets[to] + bytes < at)
+      to++;
+    if (tokens.offsets[to] + bytes == at)
+      break;
+  }
+  fresh.types.pop_back();
+  fresh.offsets.pop_back();
+  fresh.lengths.pop_back();
+  int64_t shift = int64_t(fresh.size()) - int64_t(to - from);
+
+  // Kept until the parse has gone through.
+  TokenStream replaced;
+  replaced.source = old.substr(prefix, oldEnd - prefix);
+  replaced.types.assign(tokens.types.begin() + from,
+                        tokens.types.begin() + to);
+  replaced.offsets.assign(tokens.offsets.begin() + from,
+                          tokens.offsets.begin() + to);
+  replaced.lengths.assign(tokens.lengths.begin() + from,
+                          tokens.lengths.begin() + to);
+  old.replace(prefix, oldEnd - prefix, text, prefix, newEnd - prefix);
+  splice(tokens, from, to, fresh, bytes);
+
+  // Parse again from the first top-level statement that looked at a replaced
+  // token, until one would start where one started before, after them.
+  auto first = std::lower_bound(starts.begin() + 1, starts.end(), from) -
+               starts.begin() - 1;
+  auto reuse = Reuse{parsed, uint32_t(from), uint32_t(to), shift};
+  std::vector<ParsedStmt> reparsed;
+  std::vector<std::shared_ptr<Stmt>> fresher;
+  std::vector<uint32_t> fresherStarts;
+  size_t kept = 0;
+  try {
+    auto parser = Parser(tokens, starts[first], (changes.size() + 1) << 32,
+                         &reuse, &reparsed);
+    for (;;) {
+      int64_t at = parser.next();
+      if (at >= int64_t(to) + shift) {
+        auto found = std::lower_bound(starts.begin() + first, starts.end(),
+                                      uint32_t(at - shift));
+        if (found != starts.end() && *found == at - shift) {
+          kept = found - starts.begin();
+          break;
+        }
+      }
+      fresherStarts.push_back(at);
+      fresher.push_back(parser.parseStatement());
+    }
+  } catch (...) {
+    splice(tokens, from, from + fresh.size(), replaced, -bytes);
+    old.replace(prefix, newEnd - prefix, replaced.source);
+    throw;
+  }
+
+  auto lo = std::lower_bound(parsed.begin(), parsed.end(), starts[first],
+                             [](const ParsedStmt &stmt, uint32_t first) {
+                               return stmt.first < first;
+                             }) -
+            parsed.begin();
+  auto hi = std::lower_bound(parsed.begin() + lo, parsed.end(),
+                             starts[kept],
+                             [](const ParsedStmt &stmt, uint32_t first) {
+                               return stmt.first < first;
+                             }) -
+            parsed.begin();
+  replace(parsed, lo, hi, reparsed);
+  replace(stmts, first, kept, fresher);
+  if (shift != 0) {
+    for (auto i = lo + reparsed.size(); i < parsed.size(); i++) {
+      parsed[i].first += shift;
+      parsed[i].end += shift;
+    }
+    for (auto i = kept; i < starts.size(); i++) {
+      starts[i] += shift;
+    }
+  }
+  replace(starts, first, kept, fresherStarts);
+  changes.push_back({prefix, oldEnd - prefix, newEnd - prefix});
+}
+
+size_t IncrementalProgram::locate(size_t pos) const {
+  if (pos == ScriptError::NO_POSITION)
+    return pos;
+  size_t offset = pos & 0xffffffff;
+  for (auto i = pos >> 32; i < changes.size(); i++) {
+    auto &change = changes[i];
+    if (offset >= change.offset + change.deleted)
+      offset = offset - change.deleted + change.inserted;
+    else if (offset >= change.offset)
+      return ScriptError::NO_POSITION;
+  }
+  // Then the edits since that haven't parsed yet.
+  if (offset >= tokens.source.size() - suffix)
+    return offset - tokens.source.size() + text.size();
+  if (offset >= prefix)
+    return ScriptError::NO_POSITION;
+  return offset;
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include "ast.hpp"
+#include "parser.hpp"
+#include "token.hpp"
+#include <string>
+#include <string_view>
+#include <vector>
+
+// A program kept up to date with edits to its source, for editors and hosts
+// that resubmit a large script after every small change.
+//
+// An edit is scanned again from the token before it up to the first token
+// after it that starts where a token started before. Statements that looked
+// at none of the new tokens are taken back at any depth: the top-level
+// statements around the edit as they are, and the ones containing it are
+// parsed again around their untouched blocks and nested statements. So the
+// scanning and parsing an edit costs grows with the tokens it touches and the
+// statements beside it in the blocks enclosing it, not with the file; the rest
+// is moving flat arrays along.
+//
+// Nodes are never modified, so statements taken from an earlier revision can
+// still be running. Node positions are tagged with the revision the node was
+// parsed in, and locate() says where they are in the current source.
+class IncrementalProgram {
+public:
+  IncrementalProgram(std::string source);
+
+  // Replaces deleted bytes at offset with inserted. If the new source doesn't
+  // scan or parse, this throws a ScriptError positioned in source() and
+  // statements() stays as it was. The source is changed either way, and the
+  // next edit carries on from it.
+  void edit(size_t offset, size_t deleted, std::string_view inserted);
+
+  const std::string &source() const { return text; }
+  const std::vector<std::shared_ptr<Stmt>> &statements() const { return stmts; }
+  // Where a node's position, such as a run-time ScriptError's, now is in
+  // source(), or NO_POSITION if the text there has been edited away. Errors
+  // from the constructor and edit() are in source() already.
+  size_t locate(size_t pos) const;
+  size_t revision() const { return changes.size(); }
+
+private:
+  // How the source changed from one revision to the next.
+  struct Change {
+    size_t offset, deleted, inserted;
+  };
+
+  std::string text;
+  // As of the current revision, which text may have moved on from if the
+  // edits since don't parse. They only differ after the first prefix bytes
+  // and before the last suffix bytes of each.
+  TokenStream tokens;
+  size_t prefix, suffix;
+  // Whether text has edits that didn't parse.
+  bool pending;
+  std::vector<std::shared_ptr<Stmt>> stmts;
+  // The first token of each of stmts, then the T_EOF token.
+  std::vector<uint32_t> starts;
+  std::vector<ParsedStmt> parsed;
+  std::vector<Change> changes;
+
+  void update();
+};
@@ -1,65 +1,379 @@
 #include "interpreter.hpp"
+#include "array.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 
-Evaluator::Evaluator() : vars(std::make_shared<Scope<lvalue>>()) {}
+// Integer fast path. Returns nullptr when the result leaves the safe integer
+// range or wouldn't be an integer, in which case the caller redoes the
+// operation in double.
+static Value intArith(BinopType op, int64_t lhs, int64_t rhs) {
+  int64_t res;
+  switch (op) {
+  case BinopType::ADD:
+    res = lhs + rhs;
+    break;
+  case BinopType::SUB:
+    res = lhs - rhs;
+    break;
+  case BinopType::MUL:
+    if (__builtin_mul_overflow(lhs, rhs, &res))
+      return nullptr;
+    // 0 * -n is -0.0 in double, which an integer can't represent.
+    if (res == 0 && (lhs < 0 || rhs < 0))
+      return nullptr;
+    break;
+  case BinopType::DIV:
+    if (rhs == 0 || lhs % rhs != 0 || (lhs == 0 && rhs < 0))
+      return nullptr;
+    res = lhs / rhs;
+    break;
+  case BinopType::GT:
+    return lhs > rhs;
+  case BinopType::GE:
+    return lhs >= rhs;
+  case BinopType::LT:
+    return lhs < rhs;
+  case BinopType::LE:
+    return lhs <= rhs;
+  default:
+    return nullptr;
+  }
+  if (!isSafeInt(res))
+    return nullptr;
+  return res;
+}
+
+// Makes scope the current scope for the lifetime of the guard, so a runtime
+// error unwinding out of a block or call leaves the Evaluator where it was.
+class EnterScope {
+  std::shared_ptr<Scope<Value>> &vars;
+  std::shared_ptr<Scope<Value>> saved;
+
+public:
+  EnterScope(std::shared_ptr<Scope<Value>> &vars,
+             std::shared_ptr<Scope<Value>> scope)
+      : vars(vars), saved(std::move(vars)) {
+    vars = std::move(scope);
+  }
+  ~EnterScope() { vars = std::move(saved); }
+};
+
+// Counts a call in progress for the lifetime of the guard.
+class EnterCall {
+  size_t &depth;
+
+public:
+  EnterCall(size_t &depth) : depth(depth) { depth++; }
+  ~EnterCall() { depth--; }
+};
+
+static double nativeClock() {
+  using namespace std::chrono;
+  return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+Evaluator::Evaluator()
+    : globals(make<Scope<Value>>(&heap)), vars(globals),
+      collectAt(MIN_COLLECT_AT), current(nullptr),
+      stepsLeft(UINT64_MAX), sliceLeft(0), timed(false), depth(0),
+      maxDepth(Budget::DEFAULT_DEPTH) {
+  defineNative("clock", nativeClock);
+  defineTaskNatives();
+  defineArrayNatives();
+  defineCollectionNatives();
+}
 
-stdx::any Evaluator::run(std::vector<std::shared_ptr<Stmt>> &stmt) {
-  stdx::any last;
+Evaluator::~Evaluator() {
+  cancelTasks();
+  // Global functions close over the global scope; break the cycle.
+  globals->reset(nullptr);
+  collectCycles();
+}
+
+void Evaluator::setBudget(const Budget &budget) {
+  stepsLeft = budget.steps != 0 ? budget.steps : UINT64_MAX;
+  sliceLeft = 0;
+  timed = budget.time.count() != 0;
+  deadline = std::chrono::steady_clock::now() + budget.time;
+  heap.setLimit(budget.memory != 0 ? budget.memory : SIZE_MAX);
+  maxDepth = budget.depth != 0 ? budget.depth : SIZE_MAX;
+}
+
+// Long enough that reading the clock is lost in the noise, short enough that
+// a deadline is noticed within microseconds.
+static constexpr uint64_t STEP_SLICE = 1024;
+
+void Evaluator::nextSlice() {
+  // Stay exhausted, so that anything run after the error fails as well.
+  sliceLeft = 0;
+  if (stepsLeft == 0)
+    throw ScriptError{"Step limit exceeded", ScriptError::NO_POSITION,
+                      ScriptError::STEP_LIMIT};
+  if (timed && std::chrono::steady_clock::now() >= deadline)
+    throw ScriptError{"Deadline exceeded", ScriptError::NO_POSITION,
+                      ScriptError::DEADLINE};
+  auto slice = std::min(stepsLeft, STEP_SLICE);
+  stepsLeft -= slice;
+  // This step is the first of the slice.
+  sliceLeft = slice - 1;
+}
+
+Value Evaluator::run(const std::vector<std::shared_ptr<Stmt>> &stmt) {
+  Value last;
   for (auto &it : stmt) {
     last = run(*it);
   }
+  // Give tasks spawned by a top-level program their turn.
+  if (current == nullptr)
+    runTasks();
   return last;
 }
-stdx::any Evaluator::run(Stmt &stmt) { return stmt.accept(*this); }
+Value Evaluator::run(const Program &program) {
+  return run(program.statements());
+}
+Value Evaluator::run(const Stmt &stmt) {
+  if (stmt.kind == StmtKind::ExpressionStmt)
+    return visit(*static_cast<const ExpressionStmt &>(stmt).expr);
+  visit(stmt);
+  return nullptr;
+}
+
+std::shared_ptr<Function> Evaluator::function(const std::string &name) {
+  auto val = globals->find(name);
+  if (val == nullptr)
+    throw "No such function";
+  if (auto fn = std::get_if<std::shared_ptr<Function>>(val))
+    return *fn;
+  throw "Not a function";
+}
+
+Value Evaluator::call(const Function &fn, const Value *args, size_t argc) {
+  checkArity(fn, argc);
+  auto frame = acquireFrame(fn.closure);
+  bindArgs(*frame, fn, args);
+  auto result = execBody(fn, frame);
+  releaseFrame(frame);
+  return result;
+}
+
+std::shared_ptr<String> Evaluator::string(std::string_view chars) {
+  return make<String>(chars, &heap);
+}
+
+std::shared_ptr<String> Evaluator::buffer(size_t n) {
+  return make<String>(n, &heap);
+}
 
-stdx::any Evaluator::visitExpressionStmt(ExpressionStmt &stmt) {
-  return stmt.expr->accept(*this);
+std::shared_ptr<String> Evaluator::slice(std::shared_ptr<String> str,
+                                         size_t offset, size_t length) {
+  return make<String>(std::move(str), offset, length, &heap);
 }
-stdx::any Evaluator::visitBlock(Block &block) {
-  auto ps = vars;
-  vars = std::make_shared<Scope<lvalue>>(vars);
-  for (auto &stmt : block.stmts) {
-    run(*stmt);
+
+// Below this size a copy is cheaper than a rope node, and it keeps short
+// strings flat.
+static constexpr size_t ROPE_THRESHOLD = 64;
+
+std::shared_ptr<String> Evaluator::concat(const std::shared_ptr<String> &lhs,
+                                          const std::shared_ptr<String> &rhs) {
+  if (lhs->size() == 0)
+    return rhs;
+  if (rhs->size() == 0)
+    return lhs;
+  if (lhs->size() + rhs->size() > String::MAX_SIZE)
+    throw "String too long";
+  if (lhs->size() + rhs->size() > ROPE_THRESHOLD)
+    return make<String>(lhs, rhs, &heap);
+  char chars[ROPE_THRESHOLD];
+  auto l = lhs->view(), r = rhs->view();
+  memcpy(chars, l.data(), l.size());
+  memcpy(chars + l.size(), r.data(), r.size());
+  return make<String>(std::string_view(chars, l.size() + r.size()), &heap);
+}
+
+std::shared_ptr<Scope<Value>>
+Evaluator::acquireFrame(std::shared_ptr<Scope<Value>> parent) {
+  if (framePool.empty())
+    return make<Scope<Value>>(&heap, std::move(parent));
+  auto frame = std::move(framePool.back());
+  framePool.pop_back();
+  frame->reset(std::move(parent));
+  return frame;
+}
+
+// How many of the functions bound in frame close over it and are held by
+// nothing else.
+static long ownClosures(const Scope<Value> &frame) {
+  long count = 0;
+  frame.forEach([&count, &frame](std::string_view, const Value &val) {
+    auto fn = std::get_if<std::shared_ptr<Function>>(&val);
+    if (fn != nullptr && (*fn)->closure.get() == &frame &&
+        fn->use_count() == 1)
+      count++;
+  });
+  return count;
+}
+
+void Evaluator::releaseFrame(std::shared_ptr<Scope<Value>> &frame) {
+  // Functions declared in the frame refer back to it; if nothing else holds
+  // them or the frame, they all go together.
+  if (frame.use_count() > 1 && frame.use_count() == 1 + ownClosures(*frame))
+    frame->reset(nullptr);
+  if (frame.use_count() == 1) {
+    frame->reset(nullptr);
+    framePool.push_back(std::move(frame));
+    return;
   }
-  vars = ps;
-  return nullptr;
+  // A frame captured by a closure has to stay as it is.
+  suspects.push_back(frame);
+  frame = nullptr;
+  if (suspects.size() >= collectAt)
+    collectCycles();
 }
-stdx::any Evaluator::visitFun(Fun &) { return nullptr; }
-stdx::any Evaluator::visitIf(If &stmt) {
-  auto cond = stmt.cond->accept(*this);
-  if (isTruthy(cond)) {
-    stmt.ifTrue->accept(*this);
-  } else if (stmt.ifFalse != nullptr) {
-    stmt.ifFalse->accept(*this);
+
+void Evaluator::checkArity(const Function &fn, size_t argc) {
+  if (argc != fn.decl->bindings.size())
+    throw "Wrong number of arguments";
+}
+
+void Evaluator::bindArgs(Scope<Value> &frame, const Function &fn,
+                         const Value *args) {
+  auto &bindings = fn.decl->bindings;
+  for (size_t i = 0; i < bindings.size(); i++) {
+    frame.insert(bindings[i], args[i]);
   }
-  return nullptr;
 }
-stdx::any Evaluator::visitPrint(Print &stmt) {
-  auto val = stmt.expr->accept(*this);
-  std::cout << toString(val) << std::endl;
+
+// A task's stack can't grow, so whatever the depth limit, calls on one also
+// stop while this much of it is left for natives, printing and unwinding.
+static constexpr size_t TASK_STACK_RESERVE = 32 * 1024;
+
+Value Evaluator::execBody(const Function &fn,
+                          std::shared_ptr<Scope<Value>> &frame) {
+  step();
+  if (depth == maxDepth ||
+      (current != nullptr &&
+       current->fiber.stackLeft() < TASK_STACK_RESERVE))
+    throw ScriptError{"Stack depth exceeded", ScriptError::NO_POSITION,
+                      ScriptError::STACK_LIMIT};
+  EnterCall call(depth);
+  EnterScope scope(vars, frame);
+  for (auto &stmt : fn.decl->body) {
+    if (visit(*stmt) == Completion::Return)
+      return std::move(returnValue);
+  }
   return nullptr;
 }
-stdx::any Evaluator::visitWhile(While &stmt) {
-  while (isTruthy(stmt.cond->accept(*this))) {
-    stmt.body->accept(*this);
+
+Completion Evaluator::visitExpressionStmt(const ExpressionStmt &stmt) {
+  visit(*stmt.expr);
+  return Completion::Normal;
+}
+Completion Evaluator::visitBlock(const Block &block) {
+  auto frame = acquireFrame(vars);
+  auto completion = Completion::Normal;
+  {
+    EnterScope scope(vars, frame);
+    for (auto &stmt : block.stmts) {
+      completion = visit(*stmt);
+      if (completion != Completion::Normal)
+        break;
+    }
   }
-  return nullptr;
+  releaseFrame(frame);
+  return completion;
+}
+Completion Evaluator::visitFun(const Fun &decl) {
+  auto fn = Function{decl.shared_from_this(), vars};
+  vars->insert(decl.name, make<Function>(std::move(fn)));
+  return Completion::Normal;
 }
-stdx::any Evaluator::visitVarDecl(VarDecl &decl) {
-  auto val = stdx::any_cast<lvalue>(decl.init->accept(*this));
+Completion Evaluator::visitReturn(const Return &stmt) {
+  returnValue = stmt.value != nullptr ? visit(*stmt.value) : nullptr;
+  return Completion::Return;
+}
+Completion Evaluator::visitBreak(const Break &) { return Completion::Break; }
+Completion Evaluator::visitContinue(const Continue &) {
+  return Completion::Continue;
+}
+Completion Evaluator::visitIf(const If &stmt) {
+  auto cond = visit(*stmt.cond);
+  if (isTruthy(cond))
+    return visit(*stmt.ifTrue);
+  if (stmt.ifFalse != nullptr)
+    return visit(*stmt.ifFalse);
+  return Completion::Normal;
+}
+Completion Evaluator::visitPrint(const Print &stmt) {
+  output.print(visit(*stmt.expr));
+  return Completion::Normal;
+}
+Completion Evaluator::visitWhile(const While &stmt) {
+  while (isTruthy(visit(*stmt.cond))) {
+    step();
+    auto completion = visit(*stmt.body);
+    if (completion == Completion::Break)
+      break;
+    if (completion == Completion::Return)
+      return completion;
+  }
+  return Completion::Normal;
+}
+Completion Evaluator::visitVarDecl(const VarDecl &decl) {
+  Value val = nullptr;
+  if (decl.init != nullptr)
+    val = visit(*decl.init);
   vars->insert(decl.ident, val);
-  return nullptr;
+  return Completion::Normal;
 }
-stdx::any Evaluator::visitBinop(Binop &op) {
+// Faults inside an expression are raised as plain strings; the innermost
+// node that can fault turns them into a ScriptError at its own position.
+Value Evaluator::visitBinop(const Binop &op) try {
+  if (op.op == BinopType::ASSIGN && op.lhs->kind == ExprKind::Index) {
+    auto &target = static_cast<const Index &>(*op.lhs);
+    auto object = visit(*target.object);
+    auto index = visit(*target.index);
+    auto rhs = visit(*op.rhs);
+    auto array = std::get_if<std::shared_ptr<Array>>(&object);
+    if (array == nullptr)
+      throw "Can only index arrays";
+    (*array)->data[toIndex(index, (*array)->data.size())] = asNumber(rhs);
+    return rhs;
+  }
   if (op.op == BinopType::ASSIGN) {
-    auto target = std::dynamic_pointer_cast<Variable>(op.lhs);
-    if (!target)
+    if (op.lhs->kind != ExprKind::Variable)
       throw "Can't assign to that, stupid";
-    double rhs = stdx::any_cast<double>(op.rhs->accept(*this));
-    (*vars)[target->ident] = rhs;
+    auto &target = static_cast<const Variable &>(*op.lhs);
+    auto rhs = visit(*op.rhs);
+    (*vars)[target.ident] = rhs;
     return rhs;
   }
-  double lhs = stdx::any_cast<double>(op.lhs->accept(*this));
-  double rhs = stdx::any_cast<double>(op.rhs->accept(*this));
+  auto lval = visit(*op.lhs);
+  auto rval = visit(*op.rhs);
+  switch (op.op) {
+  case BinopType::EQ:
+    return valuesEqual(lval, rval);
+  case BinopType::NE:
+    return !valuesEqual(lval, rval);
+  default:
+    break;
+  }
+  if (op.op == BinopType::ADD) {
+    auto ls = std::get_if<std::shared_ptr<String>>(&lval);
+    auto rs = std::get_if<std::shared_ptr<String>>(&rval);
+    if (ls && rs)
+      return concat(*ls, *rs);
+    if (ls || rs)
+      throw "Operands must be two numbers or two strings";
+  }
+  auto li = std::get_if<int64_t>(&lval), ri = std::get_if<int64_t>(&rval);
+  if (li && ri) {
+    auto res = intArith(op.op, *li, *ri);
+    if (!std::holds_alternative<std::nullptr_t>(res))
+      return res;
+  }
+  double lhs = asNumber(lval);
+  double rhs = asNumber(rval);
   switch (op.op) {
   case BinopType::ADD:
     return lhs + rhs;
@@ -79,10 +393,58 @@ stdx::any Evaluator::visitBinop(Binop &op) {
   case BinopType::LE:
     return lhs <= rhs;
   default:
-    return 0;
+    return nullptr;
+  }
+} catch (const char *e) {
+  throw ScriptError{e, op.pos};
+}
+Value Evaluator::visitUnop(const Unop &) { return nullptr; }
+Value Evaluator::visitLiteral(const Literal &op) { return op.value; }
+Value Evaluator::visitVariable(const Variable &v) try {
+  return (*vars)[v.ident];
+} catch (const char *e) {
+  throw ScriptError{e, v.pos};
+}
+Value Evaluator::visitIndex(const Index &index) try {
+  auto object = visit(*index.object);
+  auto key = visit(*index.index);
+  if (auto array = std::get_if<std::shared_ptr<Array>>(&object)) {
+    auto &data = (*array)->data;
+    return data[toIndex(key, data.size())];
+  }
+  if (auto list = std::get_if<std::shared_ptr<List>>(&object))
+    return (**list)[toIndex(key, (*list)->size())];
+  if (auto dict = std::get_if<std::shared_ptr<Dict>>(&object)) {
+    auto val = (*dict)->find(key);
+    return val != nullptr ? *val : nullptr;
+  }
+  throw "Can only index arrays, lists and dicts";
+} catch (const char *e) {
+  throw ScriptError{e, index.pos};
+}
+Value Evaluator::visitCall(const Call &call) try {
+  auto callee = visit(*call.callee);
+  if (auto native = std::get_if<std::shared_ptr<Native>>(&callee)) {
+    if (call.args.size() != (*native)->arity)
+      throw "Wrong number of arguments";
+    Value argv[MAX_NATIVE_ARGS];
+    for (size_t i = 0; i < call.args.size(); i++) {
+      argv[i] = visit(*call.args[i]);
+    }
+    return (*native)->thunk(*this, (*native)->fn, argv);
+  }
+  auto fn = std::get_if<std::shared_ptr<Function>>(&callee);
+  if (fn == nullptr)
+    throw "Can only call functions";
+  auto &bindings = (*fn)->decl->bindings;
+  checkArity(**fn, call.args.size());
+  auto frame = acquireFrame((*fn)->closure);
+  for (size_t i = 0; i < bindings.size(); i++) {
+    frame->insert(bindings[i], visit(*call.args[i]));
   }
+  auto result = execBody(**fn, frame);
+  releaseFrame(frame);
+  return result;
+} catch (const char *e) {
+  throw ScriptError{e, call.pos};
 }
-stdx::any Evaluator::visitUnop(Unop &) { return nullptr; }
-stdx::any Evaluator::visitLiteral(Literal &op) { return op.value; }
-stdx::any Evaluator::visitVariable(Variable &v) { return (*vars)[v.ident]; }
-stdx::any Evaluator::visitCall(Call &) { return nullptr; }
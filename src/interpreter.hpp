@@ -1,68 +1,387 @@
 #pragma once
 #include "ast.hpp"
-#include <map>
+#include "error.hpp"
+#include "fiber.hpp"
+#include "heap.hpp"
+#include "output.hpp"
+#include "persistent.hpp"
+#include "program.hpp"
+#include "table.hpp"
+#include <chrono>
+#include <deque>
 #include <string>
-#include <typeinfo>
-
-typedef double lvalue;
+#include <tuple>
+#include <utility>
 
+// Bindings are kept in a flat vector: most scopes hold a handful of names, so
+// a linear scan beats hashing, and a cleared vector keeps its capacity. That
+// is what lets the Evaluator recycle call frames without allocating. A scope
+// that outgrows the scan (in practice, the globals) moves into a hash table.
+// Bindings, names included, live in the isolate's Heap.
 template <typename T> class Scope {
-  std::map<std::string, T> vars;
+  static constexpr size_t SCAN_LIMIT = 16;
+
+  typedef std::basic_string<char, std::char_traits<char>, HeapAllocator<char>>
+      Key;
+  std::vector<std::pair<Key, T>, HeapAllocator<std::pair<Key, T>>> vars;
+  HashTable<T, HeapAllocator<char>> table;
   std::shared_ptr<Scope<T>> parent;
 
 public:
-  Scope() : parent(nullptr) {}
-  Scope(std::shared_ptr<Scope<T>> parent) : parent(parent) {}
-
-  T &operator[](const std::string &key) {
-    if (vars.count(key))
-      return vars[key];
-    if (parent != nullptr)
-      return (*parent)[key];
+  Scope(Heap *heap, std::shared_ptr<Scope<T>> parent = nullptr)
+      : vars(heap), table(heap), parent(std::move(parent)) {}
+
+  T &operator[](std::string_view key) {
+    for (auto scope = this; scope != nullptr; scope = scope->parent.get()) {
+      if (auto var = scope->find(key))
+        return *var;
+    }
     throw "No such var";
   }
-  void insert(std::string &key, T value) { vars[key] = value; }
-};
+  T *find(std::string_view key) {
+    if (table.capacity() != 0)
+      return table.find(key);
+    for (auto &var : vars) {
+      if (std::string_view(var.first) == key)
+        return &var.second;
+    }
+    return nullptr;
+  }
+  void insert(std::string_view key, T value) {
+    if (auto var = find(key)) {
+      *var = std::move(value);
+    } else if (table.capacity() != 0) {
+      table.insert(key, std::move(value));
+    } else if (vars.size() < SCAN_LIMIT) {
+      vars.emplace_back(std::piecewise_construct,
+                        std::forward_as_tuple(key, vars.get_allocator()),
+                        std::forward_as_tuple(std::move(value)));
+    } else {
+      for (auto &var : vars) {
+        table.insert(var.first, std::move(var.second));
+      }
+      vars.clear();
+      table.insert(key, std::move(value));
+    }
+  }
+  void reset(std::shared_ptr<Scope<T>> parent) {
+    vars.clear();
+    table.clear();
+    this->parent = std::move(parent);
+  }
 
-inline bool isTruthy(stdx::any val) {
-  if (val.type() == typeid(double)) {
-    return stdx::any_cast<double>(val) != 0.0;
+  const std::shared_ptr<Scope<T>> &outer() const { return parent; }
+  // Visits this scope's own bindings, in the order they were made unless the
+  // scope has moved into its hash table, passing names as string_views.
+  template <typename F> void forEach(F f) const {
+    for (auto &var : vars) {
+      f(std::string_view(var.first), var.second);
+    }
+    table.forEach([&f](std::string_view name, const T &value) {
+      f(name, value);
+    });
   }
-  if (val.type() == typeid(bool)) {
-    return stdx::any_cast<bool>(val);
+};
+
+struct Function {
+  std::shared_ptr<const Fun> decl;
+  std::shared_ptr<Scope<Value>> closure;
+};
+
+class Evaluator;
+
+// How a statement finished. Anything but Normal makes the enclosing
+// statements stop and pass it outward until a loop or call consumes it; a
+// returned value waits in the Evaluator meanwhile. Nothing unwinds the C++
+// stack except a real fault.
+enum class Completion : uint8_t { Normal, Return, Break, Continue };
+
+constexpr size_t MAX_NATIVE_ARGS = 8;
+
+// A C++ function callable from Lox. The thunk is instantiated for the exact
+// signature it was registered with, so arguments are unpacked straight from
+// the caller's array into typed parameters.
+struct Native {
+  typedef void (*Erased)();
+  std::string name;
+  size_t arity;
+  Erased fn;
+  Value (*thunk)(Evaluator &eval, Erased fn, const Value *args);
+};
+
+template <typename R, typename... A, size_t... I>
+Value callNative(R (*fn)(A...), const Value *args, std::index_sequence<I...>) {
+  if constexpr (std::is_void_v<R>) {
+    fn(fromValue<std::decay_t<A>>(args[I])...);
+    return nullptr;
+  } else {
+    return toValue(fn(fromValue<std::decay_t<A>>(args[I])...));
   }
-  return true;
 }
 
-inline std::string toString(stdx::any val) {
-  if (val.type() == typeid(double)) {
-    return std::to_string(stdx::any_cast<double>(val));
+template <typename R, typename... A, size_t... I>
+Value callNative(Evaluator &eval, R (*fn)(Evaluator &, A...),
+                 const Value *args, std::index_sequence<I...>) {
+  if constexpr (std::is_void_v<R>) {
+    fn(eval, fromValue<std::decay_t<A>>(args[I])...);
+    return nullptr;
+  } else {
+    return toValue(fn(eval, fromValue<std::decay_t<A>>(args[I])...));
   }
-  if (val.type() == typeid(bool)) {
-    return std::to_string(stdx::any_cast<bool>(val));
-  }
-  return "n/a";
 }
 
-class Evaluator : StmtVisitor, ExprVisitor {
-  std::shared_ptr<Scope<lvalue>> vars;
+template <typename R, typename... A>
+Value nativeThunk(Evaluator &, Native::Erased fn, const Value *args) {
+  return callNative(reinterpret_cast<R (*)(A...)>(fn), args,
+                    std::index_sequence_for<A...>{});
+}
+
+template <typename R, typename... A>
+Value evaluatorNativeThunk(Evaluator &eval, Native::Erased fn,
+                           const Value *args) {
+  return callNative(eval, reinterpret_cast<R (*)(Evaluator &, A...)>(fn),
+                    args, std::index_sequence_for<A...>{});
+}
+
+// A Lox coroutine. Its interpreter frames live on the fiber's own stack, so a
+// task can suspend anywhere in the middle of evaluating and pick up again
+// later, possibly on another thread.
+struct Task {
+  Fiber fiber;
+  std::function<void()> body;
+  std::shared_ptr<Scope<Value>> vars;
+  size_t slot;
+  size_t depth;
+  bool cancelled;
+  ScriptError error;
+
+  Task(std::function<void()> entry, std::function<void()> body)
+      : fiber(std::move(entry)), body(std::move(body)), slot(0), depth(0),
+        cancelled(false), error{nullptr, ScriptError::NO_POSITION} {}
+};
+
+// Unbounded FIFO between tasks of the same Evaluator. Sending never blocks;
+// receiving from an empty channel parks the task until something arrives.
+struct Channel {
+  std::deque<Value> buffer;
+  std::deque<std::shared_ptr<Task>> receivers;
+};
+
+// What an Evaluator may use before its run is stopped; zero means no limit.
+// Steps are loop iterations plus function calls. Memory is the whole heap of
+// the isolate, including what it held when the budget was set. Depth is how
+// many script function calls may be in progress at once, in each task; it is
+// limited by default, since the machine stack would run out first. Running
+// out throws a ScriptError of the matching limit kind.
+struct Budget {
+  static constexpr size_t DEFAULT_DEPTH = 1000;
+  uint64_t steps = 0;
+  std::chrono::milliseconds time{0};
+  size_t memory = 0;
+  size_t depth = DEFAULT_DEPTH;
+};
+
+// One isolate. An Evaluator owns all of its runtime state, including the heap
+// its objects live in, and shares nothing mutable with other Evaluators, so
+// separate threads can each run their own over the same Program.
+class Evaluator : StmtVisitor<Evaluator, Completion>,
+                  ExprVisitor<Evaluator, Value> {
+  Heap heap;
+  std::shared_ptr<Scope<Value>> globals;
+  std::shared_ptr<Scope<Value>> vars;
+  std::vector<std::shared_ptr<Scope<Value>>> framePool;
+  // Frames still referred to after their call, by a closure that escaped it.
+  // Once there are collectAt of them, collectCycles() frees the ones only a
+  // reference cycle keeps alive.
+  static constexpr size_t MIN_COLLECT_AT = 1024;
+  std::vector<std::weak_ptr<Scope<Value>>> suspects;
+  size_t collectAt;
+  Value returnValue;
+  std::vector<std::shared_ptr<Task>> tasks;
+  std::deque<std::shared_ptr<Task>> ready;
+  Task *current;
+  // Steps are handed out in slices so that charging one is a decrement; the
+  // limit and the clock are only looked at when a slice runs out.
+  uint64_t stepsLeft;
+  uint64_t sliceLeft;
+  bool timed;
+  std::chrono::steady_clock::time_point deadline;
+  // Calls in progress on the current stack: the host's, or the running
+  // task's.
+  size_t depth;
+  size_t maxDepth;
+  Output output;
 
 public:
   Evaluator();
-  stdx::any run(std::vector<std::shared_ptr<Stmt>> &stmt);
-  stdx::any run(Stmt &stmt);
+  ~Evaluator();
+  // Faults in the script are thrown as ScriptError. A top-level expression
+  // statement's value is returned; other statements return nil.
+  Value run(const std::vector<std::shared_ptr<Stmt>> &stmt);
+  Value run(const Program &program);
+  Value run(const Stmt &stmt);
+
+  // Makes a C++ function available to scripts as a global. Functions whose
+  // first parameter is an Evaluator & get the calling Evaluator passed in.
+  template <typename R, typename... A>
+  void defineNative(const std::string &name, R (*fn)(A...)) {
+    static_assert(sizeof...(A) <= MAX_NATIVE_ARGS, "Too many arguments");
+    globals->insert(name, make<Native>(Native{
+                              name, sizeof...(A),
+                              reinterpret_cast<Native::Erased>(fn),
+                              nativeThunk<R, A...>}));
+  }
+  template <typename R, typename... A>
+  void defineNative(const std::string &name, R (*fn)(Evaluator &, A...)) {
+    static_assert(sizeof...(A) <= MAX_NATIVE_ARGS, "Too many arguments");
+    globals->insert(name, make<Native>(Native{
+                              name, sizeof...(A),
+                              reinterpret_cast<Native::Erased>(fn),
+                              evaluatorNativeThunk<R, A...>}));
+  }
+
+  size_t heapSize() const { return heap.bytesInUse(); }
+  Heap::Totals heapTotals() const { return heap.totals(); }
+  // Sends print output to sink from now on; see Output for the policies.
+  // Output is buffered, so a host interleaving its own writes with a
+  // script's should flush first.
+  void setOutput(Output::Sink sink, Output::Flush policy) {
+    output.redirect(std::move(sink), policy);
+  }
+  void flushOutput() { output.flush(); }
+  // Replaces the current budget, restarting the step count and the clock.
+  // Tasks share their Evaluator's budget.
+  void setBudget(const Budget &budget);
+
+  // A zero-filled numeric array of n elements, allocated in this isolate.
+  std::shared_ptr<Array> array(size_t n);
+  std::shared_ptr<List> list(PVector items);
+  std::shared_ptr<Dict> dict(PMap items);
+  // Empty collections whose updates allocate in this isolate.
+  PVector emptyVector() { return PVector(heap.account()); }
+  PMap emptyMap() { return PMap(heap.account()); }
+  std::shared_ptr<String> string(std::string_view chars);
+  // An uninitialised string of n characters, to be filled in through
+  // String::buffer() before any script sees it.
+  std::shared_ptr<String> buffer(size_t n);
+  // Characters [offset, offset + length) of str, sharing its storage.
+  std::shared_ptr<String> slice(std::shared_ptr<String> str, size_t offset,
+                                size_t length);
+  std::shared_ptr<String> concat(const std::shared_ptr<String> &lhs,
+                                 const std::shared_ptr<String> &rhs);
+
+  // Embedding API. Look a function up once, then call it as often as needed;
+  // arguments are bound straight from the caller's array into a recycled
+  // frame, so a call does not touch the heap once the pool is warm.
+  std::shared_ptr<Function> function(const std::string &name);
+  Value call(const Function &fn, const Value *args, size_t argc);
+
+  template <typename R, typename... A> R invoke(const Function &fn, A... args) {
+    Value argv[sizeof...(A) + 1] = {toValue(args)...};
+    return fromValue<R>(call(fn, argv, sizeof...(A)));
+  }
+
+  // Calls fn once per argument tuple. The arity check and frame setup are
+  // done once for the whole batch rather than once per call.
+  template <typename R, typename... A>
+  void invokeBatch(const Function &fn, const std::tuple<A...> *args,
+                   size_t count, R *results) {
+    checkArity(fn, sizeof...(A));
+    Value argv[sizeof...(A) + 1];
+    auto frame = acquireFrame(fn.closure);
+    for (size_t i = 0; i < count; i++) {
+      std::apply(
+          [&argv](const A &... a) {
+            size_t j = 0;
+            ((argv[j++] = toValue(a)), ...);
+          },
+          args[i]);
+      bindArgs(*frame, fn, argv);
+      results[i] = fromValue<R>(execBody(fn, frame));
+      if (frame.use_count() > 1) {
+        releaseFrame(frame);
+        frame = acquireFrame(fn.closure);
+      } else {
+        frame->reset(fn.closure);
+      }
+    }
+    releaseFrame(frame);
+  }
+
+  // Coroutines. Tasks run cooperatively: only one task of an Evaluator runs
+  // at a time, and it keeps running until it yields, blocks on a channel or
+  // finishes. Code that isn't inside a task (the REPL, a host call) drives
+  // the scheduler whenever it yields or waits on a channel.
+  void spawn(std::shared_ptr<Function> fn);
+  void yield();
+  std::shared_ptr<Channel> channel();
+  void send(Channel &ch, Value val);
+  Value receive(Channel &ch);
+  // Runs every task that can make progress.
+  void runTasks();
+
+  // For hosts that multiplex many Evaluators over a thread pool: start()
+  // turns the program into a task, and each runSlice() call resumes at most
+  // n tasks, returning whether any are still runnable.
+  void start(const Program &program);
+  bool runSlice(size_t n);
+
+  // Heap snapshots. saveSnapshot() writes everything reachable from the
+  // globals to an image file; loadSnapshot() maps one and makes its globals
+  // this Evaluator's, as if the program that built them had run here. Neither
+  // works while tasks are live, since a suspended fiber can't be written out.
+  void saveSnapshot(const std::string &path);
+  void loadSnapshot(const std::string &path);
 
 private:
-  virtual stdx::any visitBinop(Binop &);
-  virtual stdx::any visitVariable(Variable &);
-  virtual stdx::any visitCall(Call &);
-  virtual stdx::any visitLiteral(Literal &);
-  virtual stdx::any visitUnop(Unop &);
-  virtual stdx::any visitExpressionStmt(ExpressionStmt &);
-  virtual stdx::any visitWhile(While &);
-  virtual stdx::any visitIf(If &);
-  virtual stdx::any visitFun(Fun &);
-  virtual stdx::any visitPrint(Print &);
-  virtual stdx::any visitBlock(Block &);
-  virtual stdx::any visitVarDecl(VarDecl &);
-};
\ No newline at end of file
+  friend StmtVisitor<Evaluator, Completion>;
+  friend ExprVisitor<Evaluator, Value>;
+  friend class SnapshotReader;
+  using StmtVisitor<Evaluator, Completion>::visit;
+  using ExprVisitor<Evaluator, Value>::visit;
+
+  template <typename T, typename... A> std::shared_ptr<T> make(A &&... args) {
+    return std::allocate_shared<T>(HeapAllocator<T>(&heap),
+                                   std::forward<A>(args)...);
+  }
+
+  std::shared_ptr<Scope<Value>>
+  acquireFrame(std::shared_ptr<Scope<Value>> parent);
+  void releaseFrame(std::shared_ptr<Scope<Value>> &frame);
+  void collectCycles();
+  void checkArity(const Function &fn, size_t argc);
+  void bindArgs(Scope<Value> &frame, const Function &fn, const Value *args);
+  Value execBody(const Function &fn, std::shared_ptr<Scope<Value>> &frame);
+  void step() {
+    if (sliceLeft-- == 0)
+      nextSlice();
+  }
+  void nextSlice();
+
+  void defineTaskNatives();
+  void defineArrayNatives();
+  void defineCollectionNatives();
+  void spawnTask(std::function<void()> body);
+  void taskMain();
+  void runOne();
+  void resumeTask(std::shared_ptr<Task> task);
+  void suspendCurrent();
+  void cancelTasks();
+
+  Value visitBinop(const Binop &);
+  Value visitVariable(const Variable &);
+  Value visitCall(const Call &);
+  Value visitIndex(const Index &);
+  Value visitLiteral(const Literal &);
+  Value visitUnop(const Unop &);
+  Completion visitExpressionStmt(const ExpressionStmt &);
+  Completion visitWhile(const While &);
+  Completion visitIf(const If &);
+  Completion visitFun(const Fun &);
+  Completion visitReturn(const Return &);
+  Completion visitBreak(const Break &);
+  Completion visitContinue(const Continue &);
+  Completion visitPrint(const Print &);
+  Completion visitBlock(const Block &);
+  Completion visitVarDecl(const VarDecl &);
+};
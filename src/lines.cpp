@@ -0,0 +1,53 @@
+#include "lines.hpp"
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+
+LineReader::LineReader(Evaluator &eval, int fd)
+    : eval(eval), fd(fd), start(0), filled(0), eof(false) {}
+
+std::shared_ptr<String> LineReader::next() {
+  for (;;) {
+    if (chunk != nullptr) {
+      auto from = chunk->buffer() + start;
+      auto end = static_cast<const char *>(memchr(from, '\n', filled - start));
+      if (end != nullptr || (eof && start < filled)) {
+        size_t length = end != nullptr ? end - from : filled - start;
+        auto line = eval.slice(chunk, start, length);
+        start += end != nullptr ? length + 1 : length;
+        return line;
+      }
+    }
+    if (eof)
+      return nullptr;
+    fill();
+  }
+}
+
+// Reads more into the current chunk if it has room. Otherwise the partial
+// line at its end moves to a fresh chunk, twice as big if the line alone
+// would fill it; lines already handed out keep the old chunk.
+void LineReader::fill() {
+  if (chunk == nullptr || filled == chunk->size()) {
+    size_t rest = filled - start;
+    auto fresh = eval.buffer(std::max(CHUNK_SIZE, rest * 2));
+    if (rest != 0)
+      memcpy(fresh->buffer(), chunk->buffer() + start, rest);
+    chunk = std::move(fresh);
+    start = 0;
+    filled = rest;
+  }
+  // Bytes past filled haven't been seen by anyone, so reading into a chunk
+  // that lines were already sliced from is safe.
+  for (;;) {
+    auto n = read(fd, chunk->buffer() + filled, chunk->size() - filled);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      throw "Can't read input";
+    if (n == 0)
+      eof = true;
+    filled += n;
+    return;
+  }
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include "interpreter.hpp"
+
+// Splits what comes in on a file descriptor into lines for a script, without
+// copying them. Input is read in large chunks straight into a string's
+// storage, and each line is a slice of the chunk it arrived in. A line kept
+// by the script keeps its whole chunk alive.
+class LineReader {
+public:
+  static constexpr size_t CHUNK_SIZE = 1 << 20;
+
+  LineReader(Evaluator &eval, int fd);
+  // The next line, without its newline, or nullptr once the input is used
+  // up. A last line with no newline still counts.
+  std::shared_ptr<String> next();
+
+private:
+  Evaluator &eval;
+  int fd;
+  std::shared_ptr<String> chunk;
+  // chunk holds [start, filled) of the input not yet handed out.
+  size_t start;
+  size_t filled;
+  bool eof;
+
+  void fill();
+};
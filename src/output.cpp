@@ -0,0 +1,89 @@
+#include "output.hpp"
+#include <cerrno>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+
+Output::Sink Output::fd(int fd) {
+  return [fd](std::string_view chars) {
+    while (!chars.empty()) {
+      auto n = ::write(fd, chars.data(), chars.size());
+      if (n < 0 && errno == EINTR)
+        continue;
+      // Like std::cout, a closed or broken stream drops output quietly.
+      if (n <= 0)
+        return;
+      chars.remove_prefix(n);
+    }
+  };
+}
+
+Output::Sink Output::string(std::string &text) {
+  return [&text](std::string_view chars) { text.append(chars); };
+}
+
+Output::Output()
+    : Output(fd(STDOUT_FILENO),
+             isatty(STDOUT_FILENO) ? Flush::LINE : Flush::FULL) {}
+
+Output::Output(Sink sink, Flush policy)
+    : sink(std::move(sink)), policy(policy),
+      buffer(std::make_unique<char[]>(CAPACITY)), used(0) {}
+
+Output::~Output() {
+  // Nowhere left to report a failing sink to.
+  try {
+    flush();
+  } catch (...) {
+  }
+}
+
+// Numbers are formatted straight into the buffer. The text is what
+// std::to_string produces, which is what print has always shown.
+void Output::print(const Value &val) {
+  if (auto i = std::get_if<int64_t>(&val)) {
+    reserve(MAX_NUMBER);
+    auto end = std::to_chars(&buffer[used], &buffer[CAPACITY], *i).ptr;
+    used = end - &buffer[0];
+    write(".000000");
+  } else if (auto d = std::get_if<double>(&val)) {
+    reserve(MAX_NUMBER);
+    used += snprintf(&buffer[used], MAX_NUMBER, "%f", *d);
+  } else if (auto b = std::get_if<bool>(&val)) {
+    write(*b ? "1" : "0");
+  } else if (auto str = std::get_if<std::shared_ptr<String>>(&val)) {
+    write((*str)->view());
+  } else {
+    write(toString(val));
+  }
+  write("\n");
+  if (policy == Flush::LINE)
+    flush();
+}
+
+void Output::write(std::string_view chars) {
+  reserve(chars.size());
+  if (chars.size() > CAPACITY) {
+    sink(chars);
+    return;
+  }
+  memcpy(&buffer[used], chars.data(), chars.size());
+  used += chars.size();
+}
+
+void Output::flush() {
+  if (used == 0)
+    return;
+  // Empty the buffer first, so a sink that throws doesn't get the same text
+  // again on the next flush.
+  auto chars = std::string_view(&buffer[0], used);
+  used = 0;
+  sink(chars);
+}
+
+void Output::redirect(Sink sink, Flush policy) {
+  flush();
+  this->sink = std::move(sink);
+  this->policy = policy;
+}
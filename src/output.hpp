@@ -0,0 +1,51 @@
+#pragma once
+#include "value.hpp"
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// Where print goes. Lines collect in a user-space buffer and reach the sink
+// in large pieces: after every line when someone is watching (LINE), or only
+// when the buffer fills up or is flushed explicitly (FULL). Whatever is left
+// is flushed when the Output is destroyed.
+class Output {
+public:
+  typedef std::function<void(std::string_view)> Sink;
+  enum class Flush : uint8_t { LINE, FULL };
+
+  // Writes to a file descriptor, carrying on after short writes.
+  static Sink fd(int fd);
+  // Appends to a string, for hosts that want a script's output in memory.
+  // The string has to outlive the Output.
+  static Sink string(std::string &text);
+
+  // Standard output, flushed per line only if it is a terminal.
+  Output();
+  Output(Sink sink, Flush policy);
+  Output(const Output &) = delete;
+  Output &operator=(const Output &) = delete;
+  ~Output();
+
+  // Writes val the way print shows it, followed by a newline.
+  void print(const Value &val);
+  void write(std::string_view chars);
+  void flush();
+  // Flushes what is buffered, then sends everything after to sink.
+  void redirect(Sink sink, Flush policy);
+
+private:
+  static constexpr size_t CAPACITY = 64 * 1024;
+  // Enough for any double printed with %f.
+  static constexpr size_t MAX_NUMBER = 512;
+
+  Sink sink;
+  Flush policy;
+  std::unique_ptr<char[]> buffer;
+  size_t used;
+
+  void reserve(size_t n) {
+    if (CAPACITY - used < n)
+      flush();
+  }
+};
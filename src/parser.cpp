@@ -1,19 +1,92 @@
 #include "parser.hpp"
+#include <algorithm>
+#include <charconv>
 
-Parser::Parser(std::vector<Token> tokens) : tokens(tokens), position(0) {}
+Parser::Parser(const TokenStream &tokens)
+    : Parser(tokens, 0, 0, nullptr, nullptr) {}
 
-std::vector<std::shared_ptr<Stmt>> Parser::parseProgram() {
+Parser::Parser(const TokenStream &tokens, size_t position, size_t tag,
+               const Reuse *reuse, std::vector<ParsedStmt> *parsed)
+    : tokens(tokens), position(position), functionDepth(0), loopDepth(0),
+      tag(tag), reuse(reuse), parsed(parsed) {}
+
+std::vector<std::shared_ptr<Stmt>> Parser::parseProgram() try {
   auto stmts = std::vector<std::shared_ptr<Stmt>>();
   while (!match(TokenType::T_EOF)) {
     stmts.push_back(statement());
   }
   return stmts;
+} catch (const char *e) {
+  auto token = std::min(position, tokens.size() - 1);
+  throw ScriptError{e, tokens.offsets[token]};
+}
+
+std::shared_ptr<Stmt> Parser::parseStatement() try {
+  return statement();
+} catch (const char *e) {
+  auto token = std::min(position, tokens.size() - 1);
+  throw ScriptError{e, tokens.offsets[token]};
 }
+
 std::shared_ptr<Stmt> Parser::statement() {
+  if (parsed == nullptr)
+    return freshStatement();
+  if (reuse != nullptr) {
+    if (auto stmt = reusedStatement())
+      return stmt;
+  }
+  // Recorded before parsing, so nested statements follow it in parsed.
+  auto slot = parsed->size();
+  parsed->push_back({uint32_t(position), 0, context(), nullptr});
+  auto stmt = freshStatement();
+  (*parsed)[slot].end = position;
+  (*parsed)[slot].stmt = stmt;
+  return stmt;
+}
+
+// The statement the previous parse found at this token, if it looked at
+// nothing that has changed since and is in the same context.
+std::shared_ptr<Stmt> Parser::reusedStatement() {
+  int64_t shift = 0;
+  if (position >= reuse->from) {
+    if (int64_t(position) < reuse->to + reuse->shift)
+      return nullptr;
+    shift = reuse->shift;
+  }
+  auto &old = reuse->old;
+  auto first = uint32_t(position - shift);
+  auto found = std::lower_bound(old.begin(), old.end(), first,
+                                [](const ParsedStmt &stmt, uint32_t first) {
+                                  return stmt.first < first;
+                                });
+  if (found == old.end() || found->first != first ||
+      found->context != context())
+    return nullptr;
+  if (first < reuse->from && found->end >= reuse->from)
+    return nullptr;
+  // Its nested statements come along, so a later parse can take those too.
+  auto last = found + 1;
+  while (last != old.end() && last->first < found->end)
+    ++last;
+  for (auto stmt = found; stmt != last; ++stmt) {
+    parsed->push_back({uint32_t(stmt->first + shift),
+                       uint32_t(stmt->end + shift), stmt->context,
+                       stmt->stmt});
+  }
+  position = found->end + shift;
+  return found->stmt;
+}
+
+uint8_t Parser::context() const {
+  return (functionDepth > 0 ? ParsedStmt::IN_FUNCTION : 0) |
+         (loopDepth > 0 ? ParsedStmt::IN_LOOP : 0);
+}
+
+std::shared_ptr<Stmt> Parser::freshStatement() {
   if (match(TokenType::T_VAR)) {
     if (!match(TokenType::T_IDENTIFIER))
       throw "Malformed var decl";
-    auto ident = prev().lexeme;
+    auto ident = std::string(prevLexeme());
     std::shared_ptr<Expr> init = nullptr;
     if (match(TokenType::T_EQUAL)) {
       init = expression();
@@ -37,11 +110,42 @@ std::shared_ptr<Stmt> Parser::statement() {
     expect(TokenType::T_LEFT_PAREN);
     auto cond = expression();
     expect(TokenType::T_RIGHT_PAREN);
+    loopDepth += 1;
     auto body = statement();
+    loopDepth -= 1;
     return std::make_shared<While>(cond, body);
   }
+  if (check(TokenType::T_BREAK)) {
+    if (loopDepth == 0)
+      throw "Can't break outside a loop";
+    advance();
+    match(TokenType::T_SEMICOLON);
+    return std::make_shared<Break>();
+  }
+  if (check(TokenType::T_CONTINUE)) {
+    if (loopDepth == 0)
+      throw "Can't continue outside a loop";
+    advance();
+    match(TokenType::T_SEMICOLON);
+    return std::make_shared<Continue>();
+  }
+  if (match(TokenType::T_FUN)) {
+    return function();
+  }
+  if (check(TokenType::T_RETURN)) {
+    if (functionDepth == 0)
+      throw "Can't return from top-level code";
+    advance();
+    std::shared_ptr<Expr> value;
+    if (!check(TokenType::T_SEMICOLON) && !check(TokenType::T_RIGHT_BRACE))
+      value = expression();
+    match(TokenType::T_SEMICOLON);
+    return std::make_shared<Return>(value);
+  }
   if (match(TokenType::T_PRINT)) {
-    return std::make_shared<Print>(expression());
+    auto expr = expression();
+    match(TokenType::T_SEMICOLON);
+    return std::make_shared<Print>(expr);
   }
   if (match(TokenType::T_LEFT_BRACE)) {
     std::vector<std::shared_ptr<Stmt>> body;
@@ -51,17 +155,46 @@ std::shared_ptr<Stmt> Parser::statement() {
     return std::make_shared<Block>(body);
   }
   auto lit = expression();
+  match(TokenType::T_SEMICOLON);
   return std::make_shared<ExpressionStmt>(lit);
 }
 
+std::shared_ptr<Stmt> Parser::function() {
+  if (!match(TokenType::T_IDENTIFIER))
+    throw "Malformed fun decl";
+  auto name = std::string(prevLexeme());
+  std::vector<std::string> bindings;
+  expect(TokenType::T_LEFT_PAREN);
+  if (!check(TokenType::T_RIGHT_PAREN)) {
+    do {
+      if (!match(TokenType::T_IDENTIFIER))
+        throw "Malformed parameter list";
+      bindings.push_back(std::string(prevLexeme()));
+    } while (match(TokenType::T_COMMA));
+  }
+  expect(TokenType::T_RIGHT_PAREN);
+  expect(TokenType::T_LEFT_BRACE);
+  // A loop around the declaration isn't one break can leave from inside.
+  auto outerLoops = loopDepth;
+  functionDepth += 1;
+  loopDepth = 0;
+  std::vector<std::shared_ptr<Stmt>> body;
+  while (!match(TokenType::T_RIGHT_BRACE)) {
+    body.push_back(statement());
+  }
+  functionDepth -= 1;
+  loopDepth = outerLoops;
+  return std::make_shared<Fun>(name, bindings, body);
+}
+
 std::shared_ptr<Expr> Parser::expression() { return assignment(); }
 
 std::shared_ptr<Expr> Parser::assignment() {
   auto lhs = equality();
   while (match(TokenType::T_EQUAL)) {
-    Token t = prev();
+    auto op = position - 1;
     auto rhs = equality();
-    lhs = std::make_shared<Binop>(BinopType::ASSIGN, lhs, rhs);
+    lhs = at(op, std::make_shared<Binop>(BinopType::ASSIGN, lhs, rhs));
   }
   return lhs;
 }
@@ -69,11 +202,13 @@ std::shared_ptr<Expr> Parser::assignment() {
 std::shared_ptr<Expr> Parser::equality() {
   auto lhs = comparison();
   while (match(TokenType::T_EQUAL_EQUAL) || match(TokenType::T_BANG_EQUAL)) {
-    Token t = prev();
-    auto rhs = multiplication();
-    lhs = std::make_shared<Binop>(
-        t.type == TokenType::T_EQUAL_EQUAL ? BinopType::EQ : BinopType::NE, lhs,
-        rhs);
+    auto op = position - 1;
+    auto t = prev();
+    auto rhs = comparison();
+    lhs = at(op, std::make_shared<Binop>(t == TokenType::T_EQUAL_EQUAL
+                                             ? BinopType::EQ
+                                             : BinopType::NE,
+                                         lhs, rhs));
   }
   return lhs;
 }
@@ -82,16 +217,17 @@ std::shared_ptr<Expr> Parser::comparison() {
   auto lhs = addition();
   while (match(TokenType::T_LESS) || match(TokenType::T_LESS_EQUAL) ||
          match(TokenType::T_GREATER) || match(TokenType::T_GREATER_EQUAL)) {
-    Token t = prev();
-    auto rhs = multiplication();
-    lhs = std::make_shared<Binop>(t.type == TokenType::T_LESS
-                                      ? BinopType::LT
-                                      : t.type == TokenType::T_LESS_EQUAL
-                                            ? BinopType::LE
-                                            : t.type == TokenType::T_GREATER
-                                                  ? BinopType::GT
-                                                  : BinopType::GE,
-                                  lhs, rhs);
+    auto op = position - 1;
+    auto t = prev();
+    auto rhs = addition();
+    lhs = at(op, std::make_shared<Binop>(
+                     t == TokenType::T_LESS
+                         ? BinopType::LT
+                         : t == TokenType::T_LESS_EQUAL
+                               ? BinopType::LE
+                               : t == TokenType::T_GREATER ? BinopType::GT
+                                                           : BinopType::GE,
+                     lhs, rhs));
   }
   return lhs;
 }
@@ -99,34 +235,89 @@ std::shared_ptr<Expr> Parser::comparison() {
 std::shared_ptr<Expr> Parser::addition() {
   auto lhs = multiplication();
   while (match(TokenType::T_PLUS) || match(TokenType::T_MINUS)) {
-    Token t = prev();
+    auto op = position - 1;
+    auto t = prev();
     auto rhs = multiplication();
-    lhs = std::make_shared<Binop>(t.type == TokenType::T_PLUS ? BinopType::ADD
-                                                              : BinopType::SUB,
-                                  lhs, rhs);
+    lhs = at(op, std::make_shared<Binop>(t == TokenType::T_PLUS
+                                             ? BinopType::ADD
+                                             : BinopType::SUB,
+                                         lhs, rhs));
   }
   return lhs;
 }
 
 std::shared_ptr<Expr> Parser::multiplication() {
-  auto lhs = primary();
+  auto lhs = call();
   while (match(TokenType::T_STAR) || match(TokenType::T_SLASH)) {
-    Token t = prev();
-    auto rhs = primary();
-    lhs = std::make_shared<Binop>(t.type == TokenType::T_STAR ? BinopType::MUL
-                                                              : BinopType::DIV,
-                                  lhs, rhs);
+    auto op = position - 1;
+    auto t = prev();
+    auto rhs = call();
+    lhs = at(op, std::make_shared<Binop>(t == TokenType::T_STAR
+                                             ? BinopType::MUL
+                                             : BinopType::DIV,
+                                         lhs, rhs));
   }
   return lhs;
 }
 
+std::shared_ptr<Expr> Parser::call() {
+  auto expr = primary();
+  for (;;) {
+    auto open = position;
+    if (match(TokenType::T_LEFT_PAREN)) {
+      std::vector<std::shared_ptr<Expr>> args;
+      if (!check(TokenType::T_RIGHT_PAREN)) {
+        do {
+          args.push_back(expression());
+        } while (match(TokenType::T_COMMA));
+      }
+      expect(TokenType::T_RIGHT_PAREN);
+      expr = at(open, std::make_shared<Call>(expr, args));
+    } else if (match(TokenType::T_LEFT_BRACKET)) {
+      auto index = expression();
+      expect(TokenType::T_RIGHT_BRACKET);
+      expr = at(open, std::make_shared<Index>(expr, index));
+    } else {
+      return expr;
+    }
+  }
+}
+
 std::shared_ptr<Expr> Parser::primary() {
   if (match(TokenType::T_NUMBER)) {
-    double val = std::stod(prev().lexeme);
-    return std::make_shared<Literal>(val);
+    auto lexeme = prevLexeme();
+    int64_t ival;
+    auto end = lexeme.data() + lexeme.size();
+    auto res = std::from_chars(lexeme.data(), end, ival);
+    if (res.ec == std::errc() && res.ptr == end && isSafeInt(ival))
+      return std::make_shared<Literal>(ival);
+    return std::make_shared<Literal>(std::stod(std::string(lexeme)));
+  }
+  if (match(TokenType::T_STRING)) {
+    auto lexeme = prevLexeme();
+    auto chars = lexeme.substr(1, lexeme.size() - 2);
+    auto str = strings.find(chars);
+    if (str == nullptr) {
+      // Literals are shared by every isolate running the program, so the
+      // hash is filled in now rather than lazily from several threads.
+      auto fresh = std::make_shared<String>(chars);
+      fresh->hash();
+      str = &strings.insert(chars, std::move(fresh));
+    }
+    return std::make_shared<Literal>(*str);
+  }
+  if (match(TokenType::T_TRUE)) {
+    return std::make_shared<Literal>(true);
+  }
+  if (match(TokenType::T_FALSE)) {
+    return std::make_shared<Literal>(false);
+  }
+  if (match(TokenType::T_NIL)) {
+    return std::make_shared<Literal>(nullptr);
   }
   if (match(TokenType::T_IDENTIFIER)) {
-    return std::make_shared<Variable>(prev().lexeme);
+    return at(position - 1,
+              std::make_shared<Variable>(std::string(prevLexeme())));
   }
   if (match(TokenType::T_LEFT_PAREN)) {
     auto expr = expression();
@@ -138,9 +329,12 @@ std::shared_ptr<Expr> Parser::primary() {
   throw "This is not an expression";
 }
 
-Token Parser::peek() const { return tokens[position]; }
-Token Parser::prev() const { return tokens[position - 1]; }
-bool Parser::check(TokenType type) const { return peek().type == type; }
+TokenType Parser::peek() const { return tokens.types[position]; }
+TokenType Parser::prev() const { return tokens.types[position - 1]; }
+std::string_view Parser::prevLexeme() const {
+  return tokens.lexeme(position - 1);
+}
+bool Parser::check(TokenType type) const { return peek() == type; }
 bool Parser::match(TokenType type) {
   if (check(type)) {
     advance();
@@ -152,5 +346,5 @@ void Parser::expect(TokenType type) {
   if (!match(type))
     throw "Unexpected token";
 }
-Token Parser::advance() { return tokens[position++]; }
-bool Parser::isAtEnd() const { return position >= tokens.size(); }
+size_t Parser::advance() { return position++; }
+bool Parser::isAtEnd() const { return position >= tokens.size(); }
\ No newline at end of file
@@ -1,31 +1,85 @@
 #pragma once
 #include "ast.hpp"
+#include "error.hpp"
+#include "table.hpp"
 #include "token.hpp"
 #include <vector>
 
+// A statement and the tokens it was parsed from, [first, end). Deciding where
+// it ends meant looking at token end as well. context says whether it was
+// inside a function or a loop, which decides where return, break and
+// continue are allowed.
+struct ParsedStmt {
+  enum Context : uint8_t { IN_FUNCTION = 1, IN_LOOP = 2 };
+  uint32_t first, end;
+  uint8_t context;
+  std::shared_ptr<Stmt> stmt;
+};
+
+// What an incremental parse may take from the previous one: old is every
+// statement it parsed, in token order, and old tokens [from, to) have since
+// been replaced by new tokens [from, to + shift). Any statement that didn't
+// look at a replaced token is still good.
+struct Reuse {
+  const std::vector<ParsedStmt> &old;
+  uint32_t from, to;
+  int64_t shift;
+};
+
 class Parser {
-  std::vector<Token> tokens;
+  const TokenStream &tokens;
   size_t position;
+  int functionDepth;
+  int loopDepth;
+  // Added to every node position.
+  size_t tag;
+  const Reuse *reuse;
+  std::vector<ParsedStmt> *parsed;
+  // Every occurrence of the same literal shares one String.
+  HashTable<std::shared_ptr<String>> strings;
 
 public:
-  Parser(std::vector<Token>);
+  // The Parser only refers to tokens, which have to outlive it: when they
+  // are a Scanner's, so does the Scanner.
+  Parser(const TokenStream &);
+  Parser(TokenStream &&) = delete;
   std::vector<std::shared_ptr<Stmt>> parseProgram();
 
+  // For IncrementalProgram. Parses top-level statements one at a time from
+  // token position on, taking what it can from reuse and adding every
+  // statement to parsed, nested ones included.
+  Parser(const TokenStream &, size_t position, size_t tag, const Reuse *reuse,
+         std::vector<ParsedStmt> *parsed);
+  std::shared_ptr<Stmt> parseStatement();
+  size_t next() const { return position; }
+
 private:
   std::shared_ptr<Stmt> statement();
+  std::shared_ptr<Stmt> freshStatement();
+  std::shared_ptr<Stmt> reusedStatement();
+  uint8_t context() const;
+  std::shared_ptr<Stmt> function();
   std::shared_ptr<Expr> expression();
   std::shared_ptr<Expr> assignment();
   std::shared_ptr<Expr> equality();
   std::shared_ptr<Expr> comparison();
   std::shared_ptr<Expr> addition();
   std::shared_ptr<Expr> multiplication();
+  std::shared_ptr<Expr> call();
   std::shared_ptr<Expr> primary();
 
-  Token peek() const;
-  Token prev() const;
+  template <typename T>
+  std::shared_ptr<T> at(size_t token, std::shared_ptr<T> node) const {
+    node->pos = tokens.offsets[token] + tag;
+    return node;
+  }
+
+  TokenType peek() const;
+  TokenType prev() const;
+  std::string_view prevLexeme() const;
   bool check(TokenType) const;
   bool match(TokenType);
   void expect(TokenType);
-  Token advance();
+  size_t advance();
   bool isAtEnd() const;
 };
@@ -0,0 +1,557 @@
+#include "persistent.hpp"
+#include "array.hpp"
+#include "interpreter.hpp"
+#include <atomic>
+#include <cmath>
+
+static constexpr unsigned BITS = 5;
+static constexpr size_t WIDTH = 1 << BITS;
+static constexpr size_t MASK = WIDTH - 1;
+
+// Edit ids are never reused, so a node stamped by a transient that has since
+// been made persistent can't be mistaken for one a later transient owns.
+static std::atomic<uint64_t> nextEdit{1};
+
+size_t hashValue(const Value &val) {
+  // Equal numbers have to hash alike whichever representation they have.
+  if (auto i = std::get_if<int64_t>(&val))
+    return std::hash<int64_t>()(*i);
+  if (auto d = std::get_if<double>(&val)) {
+    if (std::trunc(*d) == *d && std::fabs(*d) <= double(MAX_SAFE_INT))
+      return std::hash<int64_t>()(int64_t(*d));
+    return std::hash<double>()(*d);
+  }
+  if (auto str = std::get_if<std::shared_ptr<String>>(&val))
+    return (*str)->hash();
+  return std::hash<Value>()(val);
+}
+
+PVector::PVector(std::shared_ptr<SharedAccount> account)
+    : account(std::move(account)), count(0), shift(BITS) {
+  // Shared by every empty vector; edit 0 means nobody may change it.
+  static const auto empty = std::make_shared<Node>(0, nullptr);
+  root = tail = empty;
+}
+
+size_t PVector::tailOffset() const {
+  return count < WIDTH ? 0 : ((count - 1) >> BITS) << BITS;
+}
+
+const std::shared_ptr<PVector::Node> &PVector::leafFor(size_t i) const {
+  if (i >= tailOffset())
+    return tail;
+  auto node = &root;
+  for (auto level = shift; level > 0; level -= BITS) {
+    node = &(*node)->children[(i >> level) & MASK];
+  }
+  return *node;
+}
+
+const Value &PVector::operator[](size_t i) const {
+  return leafFor(i)->values[i & MASK];
+}
+
+std::shared_ptr<PVector::Node> PVector::newNode(uint64_t edit) const {
+  return std::allocate_shared<Node>(SharedAllocator<Node>(account), edit,
+                                    account);
+}
+
+std::shared_ptr<PVector::Node>
+PVector::editable(const std::shared_ptr<Node> &node, uint64_t edit) const {
+  if (edit != 0 && node->edit == edit)
+    return node;
+  return std::allocate_shared<Node>(SharedAllocator<Node>(account), *node,
+                                    edit, account);
+}
+
+std::shared_ptr<PVector::Node>
+PVector::newPath(unsigned level, std::shared_ptr<Node> node,
+                 uint64_t edit) const {
+  if (level == 0)
+    return node;
+  auto path = newNode(edit);
+  path->children.push_back(newPath(level - BITS, std::move(node), edit));
+  return path;
+}
+
+std::shared_ptr<PVector::Node>
+PVector::pushTail(unsigned level, const std::shared_ptr<Node> &parent,
+                  std::shared_ptr<Node> leaf, uint64_t edit) {
+  auto node = editable(parent, edit);
+  size_t sub = ((count - 1) >> level) & MASK;
+  std::shared_ptr<Node> child;
+  if (level == BITS)
+    child = std::move(leaf);
+  else if (sub < node->children.size())
+    child = pushTail(level - BITS, node->children[sub], std::move(leaf), edit);
+  else
+    child = newPath(level - BITS, std::move(leaf), edit);
+  if (sub < node->children.size())
+    node->children[sub] = std::move(child);
+  else
+    node->children.push_back(std::move(child));
+  return node;
+}
+
+std::shared_ptr<PVector::Node>
+PVector::popTail(unsigned level, const std::shared_ptr<Node> &node,
+                 uint64_t edit) {
+  size_t sub = ((count - 2) >> level) & MASK;
+  if (level > BITS) {
+    auto child = popTail(level - BITS, node->children[sub], edit);
+    if (child == nullptr && sub == 0)
+      return nullptr;
+    auto copy = editable(node, edit);
+    if (child == nullptr)
+      copy->children.pop_back();
+    else
+      copy->children[sub] = std::move(child);
+    return copy;
+  }
+  if (sub == 0)
+    return nullptr;
+  auto copy = editable(node, edit);
+  copy->children.pop_back();
+  return copy;
+}
+
+std::shared_ptr<PVector::Node>
+PVector::setIn(unsigned level, const std::shared_ptr<Node> &node, size_t i,
+               Value val, uint64_t edit) const {
+  auto copy = editable(node, edit);
+  if (level == 0) {
+    copy->values[i & MASK] = std::move(val);
+  } else {
+    size_t sub = (i >> level) & MASK;
+    auto child = copy->children[sub];
+    copy->children[sub] = setIn(level - BITS, child, i, std::move(val), edit);
+  }
+  return copy;
+}
+
+void PVector::doPush(Value val, uint64_t edit) {
+  if (count - tailOffset() < WIDTH) {
+    tail = editable(tail, edit);
+    tail->values.push_back(std::move(val));
+    count++;
+    return;
+  }
+  // The tail is full: it becomes a leaf of the tree, growing a new root
+  // level when the tree has no room left.
+  if ((count >> BITS) > (size_t(1) << shift)) {
+    auto grown = newNode(edit);
+    grown->children.push_back(root);
+    grown->children.push_back(newPath(shift, tail, edit));
+    root = std::move(grown);
+    shift += BITS;
+  } else {
+    root = pushTail(shift, root, tail, edit);
+  }
+  tail = newNode(edit);
+  tail->values.push_back(std::move(val));
+  count++;
+}
+
+void PVector::doSet(size_t i, Value val, uint64_t edit) {
+  if (i >= tailOffset()) {
+    tail = editable(tail, edit);
+    tail->values[i & MASK] = std::move(val);
+  } else {
+    root = setIn(shift, root, i, std::move(val), edit);
+  }
+}
+
+void PVector::doPop(uint64_t edit) {
+  if (count == 0)
+    throw "Can't pop an empty list";
+  if (count == 1) {
+    *this = PVector(account);
+    return;
+  }
+  if (count - tailOffset() > 1) {
+    tail = editable(tail, edit);
+    tail->values.pop_back();
+    count--;
+    return;
+  }
+  // The tail is about to be empty: the last leaf of the tree takes its
+  // place, and the root loses a level if only one child is left.
+  auto leaf = leafFor(count - 2);
+  auto shrunk = popTail(shift, root, edit);
+  if (shrunk == nullptr)
+    shrunk = PVector(account).root;
+  if (shift > BITS && shrunk->children.size() == 1) {
+    shrunk = shrunk->children[0];
+    shift -= BITS;
+  }
+  root = std::move(shrunk);
+  tail = std::move(leaf);
+  count--;
+}
+
+PVector PVector::push(Value val) const {
+  auto vec = *this;
+  vec.doPush(std::move(val), 0);
+  return vec;
+}
+
+PVector PVector::set(size_t i, Value val) const {
+  auto vec = *this;
+  vec.doSet(i, std::move(val), 0);
+  return vec;
+}
+
+PVector PVector::pop() const {
+  auto vec = *this;
+  vec.doPop(0);
+  return vec;
+}
+
+bool PVector::unshared() const { return unshared(root) && unshared(tail); }
+
+bool PVector::unshared(const std::shared_ptr<Node> &node) {
+  // The empty node is everybody's, but holds nothing.
+  if (node->children.empty() && node->values.empty())
+    return true;
+  if (node.use_count() != 1)
+    return false;
+  for (auto &child : node->children) {
+    if (!unshared(child))
+      return false;
+  }
+  return true;
+}
+
+PVector::Transient::Transient(PVector vec)
+    : vec(std::move(vec)), edit(nextEdit++) {}
+
+PVector PVector::Transient::persistent() {
+  // Whatever this transient built is frozen from here on; carrying on
+  // editing starts a fresh round of copies.
+  edit = nextEdit++;
+  return vec;
+}
+
+PMap::PMap(std::shared_ptr<SharedAccount> account)
+    : account(std::move(account)), count(0) {}
+
+std::shared_ptr<PMap::Node> PMap::newNode(unsigned shift,
+                                          uint64_t edit) const {
+  // Once every bit of the hash is used up, keys can only be told apart by
+  // comparing them.
+  return std::allocate_shared<Node>(SharedAllocator<Node>(account), edit,
+                                    shift >= 64, account);
+}
+
+std::shared_ptr<PMap::Node> PMap::editable(const std::shared_ptr<Node> &node,
+                                           uint64_t edit) const {
+  if (edit != 0 && node->edit == edit)
+    return node;
+  return std::allocate_shared<Node>(SharedAllocator<Node>(account), *node,
+                                    edit, account);
+}
+
+const Value *PMap::find(const Value &key) const {
+  size_t hash = hashValue(key);
+  auto node = root.get();
+  for (unsigned shift = 0; node != nullptr; shift += BITS) {
+    if (node->collisions) {
+      for (auto &entry : node->entries) {
+        if (valuesEqual(entry.key, key))
+          return &entry.val;
+      }
+      return nullptr;
+    }
+    uint32_t bit = uint32_t(1) << ((hash >> shift) & MASK);
+    if ((node->bitmap & bit) == 0)
+      return nullptr;
+    auto &entry = node->entries[__builtin_popcount(node->bitmap & (bit - 1))];
+    if (entry.child == nullptr)
+      return valuesEqual(entry.key, key) ? &entry.val : nullptr;
+    node = entry.child.get();
+  }
+  return nullptr;
+}
+
+std::shared_ptr<PMap::Node> PMap::doInsert(const std::shared_ptr<Node> &node,
+                                           unsigned shift, Entry entry,
+                                           uint64_t edit, bool &added) const {
+  if (node->collisions) {
+    auto copy = editable(node, edit);
+    for (auto &it : copy->entries) {
+      if (valuesEqual(it.key, entry.key)) {
+        it.val = std::move(entry.val);
+        return copy;
+      }
+    }
+    copy->entries.push_back(std::move(entry));
+    added = true;
+    return copy;
+  }
+  uint32_t bit = uint32_t(1) << ((entry.hash >> shift) & MASK);
+  size_t idx = __builtin_popcount(node->bitmap & (bit - 1));
+  if ((node->bitmap & bit) == 0) {
+    auto copy = editable(node, edit);
+    copy->entries.insert(copy->entries.begin() + idx, std::move(entry));
+    copy->bitmap |= bit;
+    added = true;
+    return copy;
+  }
+  auto &slot = node->entries[idx];
+  std::shared_ptr<Node> child;
+  if (slot.child != nullptr) {
+    child = doInsert(slot.child, shift + BITS, std::move(entry), edit, added);
+  } else if (valuesEqual(slot.key, entry.key)) {
+    auto copy = editable(node, edit);
+    copy->entries[idx].val = std::move(entry.val);
+    return copy;
+  } else {
+    // Two keys in one slot: both move down a level.
+    bool ignored = false;
+    child = doInsert(newNode(shift + BITS, edit), shift + BITS, slot, edit,
+                     ignored);
+    child = doInsert(child, shift + BITS, std::move(entry), edit, added);
+  }
+  auto copy = editable(node, edit);
+  copy->entries[idx] = Entry{0, nullptr, nullptr, std::move(child)};
+  return copy;
+}
+
+std::shared_ptr<PMap::Node> PMap::doRemove(const std::shared_ptr<Node> &node,
+                                           unsigned shift, size_t hash,
+                                           const Value &key, uint64_t edit,
+                                           bool &removed) const {
+  size_t idx;
+  uint32_t bit = 0;
+  if (node->collisions) {
+    for (idx = 0; idx < node->entries.size(); idx++) {
+      if (valuesEqual(node->entries[idx].key, key))
+        break;
+    }
+    if (idx == node->entries.size())
+      return node;
+  } else {
+    bit = uint32_t(1) << ((hash >> shift) & MASK);
+    if ((node->bitmap & bit) == 0)
+      return node;
+    idx = __builtin_popcount(node->bitmap & (bit - 1));
+    auto &slot = node->entries[idx];
+    if (slot.child != nullptr) {
+      auto child = doRemove(slot.child, shift + BITS, hash, key, edit, removed);
+      if (!removed)
+        return node;
+      if (child != nullptr) {
+        auto copy = editable(node, edit);
+        copy->entries[idx].child = std::move(child);
+        return copy;
+      }
+    } else if (!valuesEqual(slot.key, key)) {
+      return node;
+    }
+  }
+  removed = true;
+  if (node->entries.size() == 1)
+    return nullptr;
+  auto copy = editable(node, edit);
+  copy->entries.erase(copy->entries.begin() + idx);
+  copy->bitmap &= ~bit;
+  return copy;
+}
+
+void PMap::doInsert(Value key, Value val, uint64_t edit) {
+  size_t hash = hashValue(key);
+  bool added = false;
+  root = doInsert(root != nullptr ? root : newNode(0, edit), 0,
+                  Entry{hash, std::move(key), std::move(val), nullptr}, edit,
+                  added);
+  if (added)
+    count++;
+}
+
+void PMap::doRemove(const Value &key, uint64_t edit) {
+  if (root == nullptr)
+    return;
+  bool removed = false;
+  root = doRemove(root, 0, hashValue(key), key, edit, removed);
+  if (removed)
+    count--;
+}
+
+PMap PMap::insert(Value key, Value val) const {
+  auto map = *this;
+  map.doInsert(std::move(key), std::move(val), 0);
+  return map;
+}
+
+PMap PMap::remove(const Value &key) const {
+  auto map = *this;
+  map.doRemove(key, 0);
+  return map;
+}
+
+bool PMap::unshared() const { return root == nullptr || unshared(root); }
+
+bool PMap::unshared(const std::shared_ptr<Node> &node) {
+  if (node.use_count() != 1)
+    return false;
+  for (auto &entry : node->entries) {
+    if (entry.child != nullptr && !unshared(entry.child))
+      return false;
+  }
+  return true;
+}
+
+PMap::Transient::Transient(PMap map) : map(std::move(map)), edit(nextEdit++) {}
+
+PMap PMap::Transient::persistent() {
+  edit = nextEdit++;
+  return map;
+}
+
+static std::shared_ptr<List> asList(const Value &val) {
+  if (auto list = std::get_if<std::shared_ptr<List>>(&val))
+    return *list;
+  throw "Operand must be a list";
+}
+
+static std::shared_ptr<Dict> asDict(const Value &val) {
+  if (auto dict = std::get_if<std::shared_ptr<Dict>>(&val))
+    return *dict;
+  throw "Operand must be a dict";
+}
+
+static std::shared_ptr<List> nativeList(Evaluator &eval) {
+  return eval.list(eval.emptyVector());
+}
+
+static std::shared_ptr<Dict> nativeDict(Evaluator &eval) {
+  return eval.dict(eval.emptyMap());
+}
+
+static int64_t nativeLen(Value coll) {
+  if (auto array = std::get_if<std::shared_ptr<Array>>(&coll))
+    return int64_t((*array)->data.size());
+  if (auto list = std::get_if<std::shared_ptr<List>>(&coll))
+    return int64_t((*list)->size());
+  if (auto str = std::get_if<std::shared_ptr<String>>(&coll))
+    return int64_t((*str)->size());
+  return int64_t(asDict(coll)->size());
+}
+
+static Value nativePush(Evaluator &eval, Value coll, Value val) {
+  auto list = asList(coll);
+  if (list->builder) {
+    list->builder->push(std::move(val));
+    return coll;
+  }
+  return eval.list(list->items.push(std::move(val)));
+}
+
+static Value nativePop(Evaluator &eval, Value coll) {
+  auto list = asList(coll);
+  if (list->builder) {
+    list->builder->pop();
+    return coll;
+  }
+  return eval.list(list->items.pop());
+}
+
+static Value nativeGet(Value coll, Value key) {
+  if (auto list = std::get_if<std::shared_ptr<List>>(&coll))
+    return (**list)[toIndex(key, (*list)->size())];
+  auto val = asDict(coll)->find(key);
+  return val != nullptr ? *val : nullptr;
+}
+
+static Value nativePut(Evaluator &eval, Value coll, Value key, Value val) {
+  if (auto list = std::get_if<std::shared_ptr<List>>(&coll)) {
+    size_t i = toIndex(key, (*list)->size());
+    if ((*list)->builder) {
+      (*list)->builder->set(i, std::move(val));
+      return coll;
+    }
+    return eval.list((*list)->items.set(i, std::move(val)));
+  }
+  auto dict = asDict(coll);
+  if (dict->builder) {
+    dict->builder->insert(std::move(key), std::move(val));
+    return coll;
+  }
+  return eval.dict(dict->items.insert(std::move(key), std::move(val)));
+}
+
+static Value nativeRemove(Evaluator &eval, Value coll, Value key) {
+  auto dict = asDict(coll);
+  if (dict->builder) {
+    dict->builder->remove(key);
+    return coll;
+  }
+  return eval.dict(dict->items.remove(key));
+}
+
+static bool nativeHas(Value coll, Value key) {
+  return asDict(coll)->find(key) != nullptr;
+}
+
+static std::shared_ptr<List> nativeKeys(Evaluator &eval, Value coll) {
+  auto dict = asDict(coll);
+  PVector::Transient keys{eval.emptyVector()};
+  auto items = dict->builder ? dict->builder->persistent() : dict->items;
+  items.forEach([&keys](const Value &key, const Value &) { keys.push(key); });
+  return eval.list(keys.persistent());
+}
+
+static Value nativeTransient(Evaluator &eval, Value coll) {
+  if (auto list = std::get_if<std::shared_ptr<List>>(&coll)) {
+    auto builder = eval.list(eval.emptyVector());
+    builder->builder.emplace((*list)->builder ? (*list)->builder->persistent()
+                                              : (*list)->items);
+    return builder;
+  }
+  auto dict = asDict(coll);
+  auto builder = eval.dict(eval.emptyMap());
+  builder->builder.emplace(dict->builder ? dict->builder->persistent()
+                                         : dict->items);
+  return builder;
+}
+
+// Freezes a builder in place: it is an ordinary persistent collection from
+// here on.
+static Value nativePersistent(Value coll) {
+  if (auto list = std::get_if<std::shared_ptr<List>>(&coll)) {
+    if ((*list)->builder) {
+      (*list)->items = (*list)->builder->persistent();
+      (*list)->builder.reset();
+    }
+    return coll;
+  }
+  auto dict = asDict(coll);
+  if (dict->builder) {
+    dict->items = dict->builder->persistent();
+    dict->builder.reset();
+  }
+  return coll;
+}
+
+void Evaluator::defineCollectionNatives() {
+  defineNative("list", nativeList);
+  defineNative("dict", nativeDict);
+  defineNative("len", nativeLen);
+  defineNative("push", nativePush);
+  defineNative("pop", nativePop);
+  defineNative("get", nativeGet);
+  defineNative("put", nativePut);
+  defineNative("remove", nativeRemove);
+  defineNative("has", nativeHas);
+  defineNative("keys", nativeKeys);
+  defineNative("transient", nativeTransient);
+  defineNative("persistent", nativePersistent);
+}
+
+std::shared_ptr<List> Evaluator::list(PVector items) {
+  return make<List>(std::move(items));
+}
+
+std::shared_ptr<Dict> Evaluator::dict(PMap items) {
+  return make<Dict>(std::move(items));
+}
@@ -0,0 +1,208 @@
+#pragma once
+#include "heap.hpp"
+#include "value.hpp"
+#include <memory>
+#include <optional>
+#include <vector>
+
+// Persistent collections. An update returns a new collection that shares all
+// but O(log n) of its nodes with the old one, which stays as it was. Nodes
+// live on the global heap with atomic reference counts and are never written
+// once published, so a collection can be read, and dropped, from any number
+// of threads. (Elements are still Values: a function stored in one belongs to
+// the isolate that made it.)
+//
+// A collection made with an isolate's SharedAccount charges its nodes there,
+// so they count against the isolate's memory limit without tying them to its
+// Heap. Without one they belong to the host.
+//
+// Transients batch updates: every node a transient copies is stamped with its
+// edit id, and later updates through the same transient change those nodes
+// in place. persistent() ends the batch; the nodes are then as immutable as
+// any other.
+
+size_t hashValue(const Value &val);
+
+// Bit-partitioned vector trie, 32 children per node, with the last (up to)
+// 32 elements kept in a separate tail so pushes rarely touch the tree.
+class PVector {
+public:
+  class Transient;
+
+  explicit PVector(std::shared_ptr<SharedAccount> account = nullptr);
+  size_t size() const { return count; }
+  const Value &operator[](size_t i) const;
+
+  PVector push(Value val) const;
+  PVector set(size_t i, Value val) const;
+  PVector pop() const;
+
+  // Whether no node with elements in it is shared with another vector, so
+  // each element is referred to exactly once from here.
+  bool unshared() const;
+
+private:
+  struct Node {
+    uint64_t edit;
+    std::vector<std::shared_ptr<Node>, SharedAllocator<std::shared_ptr<Node>>>
+        children;
+    std::vector<Value, SharedAllocator<Value>> values;
+    Node(uint64_t edit, const std::shared_ptr<SharedAccount> &account)
+        : edit(edit), children(account), values(account) {}
+    Node(const Node &other, uint64_t edit,
+         const std::shared_ptr<SharedAccount> &account)
+        : edit(edit), children(other.children.begin(), other.children.end(),
+                               account),
+          values(other.values.begin(), other.values.end(), account) {}
+  };
+  std::shared_ptr<SharedAccount> account;
+  size_t count;
+  unsigned shift;
+  std::shared_ptr<Node> root;
+  std::shared_ptr<Node> tail;
+
+  size_t tailOffset() const;
+  const std::shared_ptr<Node> &leafFor(size_t i) const;
+  std::shared_ptr<Node> newNode(uint64_t edit) const;
+  std::shared_ptr<Node> editable(const std::shared_ptr<Node> &node,
+                                 uint64_t edit) const;
+  std::shared_ptr<Node> newPath(unsigned level, std::shared_ptr<Node> node,
+                                uint64_t edit) const;
+  std::shared_ptr<Node> pushTail(unsigned level,
+                                 const std::shared_ptr<Node> &parent,
+                                 std::shared_ptr<Node> leaf, uint64_t edit);
+  std::shared_ptr<Node> popTail(unsigned level,
+                                const std::shared_ptr<Node> &node,
+                                uint64_t edit);
+  std::shared_ptr<Node> setIn(unsigned level, const std::shared_ptr<Node> &node,
+                              size_t i, Value val, uint64_t edit) const;
+  static bool unshared(const std::shared_ptr<Node> &node);
+
+  void doPush(Value val, uint64_t edit);
+  void doSet(size_t i, Value val, uint64_t edit);
+  void doPop(uint64_t edit);
+};
+
+class PVector::Transient {
+public:
+  explicit Transient(PVector vec);
+  size_t size() const { return vec.size(); }
+  const Value &operator[](size_t i) const { return vec[i]; }
+  void push(Value val) { vec.doPush(std::move(val), edit); }
+  void set(size_t i, Value val) { vec.doSet(i, std::move(val), edit); }
+  void pop() { vec.doPop(edit); }
+  PVector persistent();
+
+private:
+  PVector vec;
+  uint64_t edit;
+};
+
+// Hash array mapped trie. Each level consumes 5 bits of the key's hash and
+// stores only the slots in use, indexed through a 32-bit bitmap; keys whose
+// hashes are fully equal end up together in a collision node.
+class PMap {
+public:
+  class Transient;
+
+  explicit PMap(std::shared_ptr<SharedAccount> account = nullptr);
+  size_t size() const { return count; }
+  const Value *find(const Value &key) const;
+
+  PMap insert(Value key, Value val) const;
+  PMap remove(const Value &key) const;
+
+  template <typename F> void forEach(F f) const {
+    if (root != nullptr)
+      forEach(*root, f);
+  }
+  // As for PVector.
+  bool unshared() const;
+
+private:
+  struct Node;
+  struct Entry {
+    size_t hash;
+    Value key;
+    Value val;
+    std::shared_ptr<Node> child;
+  };
+  struct Node {
+    uint64_t edit;
+    uint32_t bitmap;
+    bool collisions;
+    std::vector<Entry, SharedAllocator<Entry>> entries;
+    Node(uint64_t edit, bool collisions,
+         const std::shared_ptr<SharedAccount> &account)
+        : edit(edit), bitmap(0), collisions(collisions), entries(account) {}
+    Node(const Node &other, uint64_t edit,
+         const std::shared_ptr<SharedAccount> &account)
+        : edit(edit), bitmap(other.bitmap), collisions(other.collisions),
+          entries(other.entries.begin(), other.entries.end(), account) {}
+  };
+  std::shared_ptr<SharedAccount> account;
+  size_t count;
+  std::shared_ptr<Node> root;
+
+  template <typename F> static void forEach(const Node &node, F &f) {
+    for (auto &entry : node.entries) {
+      if (entry.child != nullptr)
+        forEach(*entry.child, f);
+      else
+        f(entry.key, entry.val);
+    }
+  }
+
+  std::shared_ptr<Node> editable(const std::shared_ptr<Node> &node,
+                                 uint64_t edit) const;
+  std::shared_ptr<Node> newNode(unsigned shift, uint64_t edit) const;
+  static bool unshared(const std::shared_ptr<Node> &node);
+  std::shared_ptr<Node> doInsert(const std::shared_ptr<Node> &node,
+                                 unsigned shift, Entry entry, uint64_t edit,
+                                 bool &added) const;
+  std::shared_ptr<Node> doRemove(const std::shared_ptr<Node> &node,
+                                 unsigned shift, size_t hash, const Value &key,
+                                 uint64_t edit, bool &removed) const;
+
+  void doInsert(Value key, Value val, uint64_t edit);
+  void doRemove(const Value &key, uint64_t edit);
+};
+
+class PMap::Transient {
+public:
+  explicit Transient(PMap map);
+  size_t size() const { return map.size(); }
+  const Value *find(const Value &key) const { return map.find(key); }
+  void insert(Value key, Value val) {
+    map.doInsert(std::move(key), std::move(val), edit);
+  }
+  void remove(const Value &key) { map.doRemove(key, edit); }
+  PMap persistent();
+
+private:
+  PMap map;
+  uint64_t edit;
+};
+
+// Script-visible wrappers. Between transient() and persistent() a List or
+// Dict is a builder: push/put change it in place and return it, rather than
+// returning an updated copy.
+struct List {
+  PVector items;
+  std::optional<PVector::Transient> builder;
+  List(PVector items) : items(std::move(items)) {}
+  size_t size() const { return builder ? builder->size() : items.size(); }
+  const Value &operator[](size_t i) const {
+    return builder ? (*builder)[i] : items[i];
+  }
+};
+
+struct Dict {
+  PMap items;
+  std::optional<PMap::Transient> builder;
+  Dict(PMap items) : items(std::move(items)) {}
+  size_t size() const { return builder ? builder->size() : items.size(); }
+  const Value *find(const Value &key) const {
+    return builder ? builder->find(key) : items.find(key);
+  }
+};
@@ -0,0 +1,119 @@
+#include "pool.hpp"
+
+WorkStealingPool::WorkStealingPool(size_t threads)
+    : pending(0), queued(0), nextWorker(0), stopping(false) {
+  if (threads == 0)
+    threads = 1;
+  for (size_t i = 0; i < threads; i++) {
+    workers.push_back(std::make_unique<Worker>());
+  }
+  for (size_t i = 0; i < threads; i++) {
+    this->threads.emplace_back(&WorkStealingPool::work, this, i);
+  }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+  drain();
+  {
+    std::lock_guard<std::mutex> guard(idleLock);
+    stopping = true;
+  }
+  wakeup.notify_all();
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+void WorkStealingPool::submit(Job job) {
+  pending += 1;
+  auto &worker = *workers[nextWorker++ % workers.size()];
+  {
+    std::lock_guard<std::mutex> guard(worker.lock);
+    worker.jobs.push_back(std::move(job));
+  }
+  {
+    std::lock_guard<std::mutex> guard(idleLock);
+    queued += 1;
+  }
+  wakeup.notify_one();
+}
+
+void WorkStealingPool::drain() {
+  std::unique_lock<std::mutex> guard(idleLock);
+  drained.wait(guard, [this] { return pending == 0; });
+}
+
+void WorkStealingPool::wait() {
+  drain();
+  std::exception_ptr e;
+  {
+    std::lock_guard<std::mutex> guard(idleLock);
+    std::swap(e, failure);
+  }
+  if (e)
+    std::rethrow_exception(e);
+}
+
+bool WorkStealingPool::take(size_t self, Job &job) {
+  {
+    auto &own = *workers[self];
+    std::lock_guard<std::mutex> guard(own.lock);
+    if (!own.jobs.empty()) {
+      job = std::move(own.jobs.back());
+      own.jobs.pop_back();
+      return true;
+    }
+  }
+  for (size_t i = 1; i < workers.size(); i++) {
+    auto &victim = *workers[(self + i) % workers.size()];
+    std::lock_guard<std::mutex> guard(victim.lock);
+    if (!victim.jobs.empty()) {
+      job = std::move(victim.jobs.front());
+      victim.jobs.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
+
+void WorkStealingPool::work(size_t self) {
+  for (;;) {
+    Job job;
+    if (!take(self, job)) {
+      std::unique_lock<std::mutex> guard(idleLock);
+      wakeup.wait(guard, [this] { return stopping || queued > 0; });
+      if (stopping && queued == 0)
+        return;
+      continue;
+    }
+    queued -= 1;
+    bool more = false;
+    try {
+      more = job();
+    } catch (...) {
+      std::lock_guard<std::mutex> guard(idleLock);
+      if (!failure)
+        failure = std::current_exception();
+    }
+    if (more) {
+      auto &own = *workers[self];
+      {
+        std::lock_guard<std::mutex> guard(own.lock);
+        own.jobs.push_front(std::move(job));
+      }
+      queued += 1;
+      wakeup.notify_one();
+      continue;
+    }
+    job = nullptr;
+    if (--pending == 0) {
+      std::lock_guard<std::mutex> guard(idleLock);
+      drained.notify_all();
+    }
+  }
+}
+
+WorkStealingPool &sharedPool() {
+  static WorkStealingPool pool;
+  return pool;
+}
@@ -0,0 +1,98 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads, each with its own job deque. A worker takes
+// from the back of its own deque and, when that runs dry, steals from the
+// front of the others'. A job returns true if it has more to do; it is then
+// put back at the front of the deque, where it is the first thing an idle
+// worker will steal.
+class WorkStealingPool {
+public:
+  typedef std::function<bool()> Job;
+
+  WorkStealingPool(size_t threads = std::thread::hardware_concurrency());
+  WorkStealingPool(const WorkStealingPool &) = delete;
+  WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+  ~WorkStealingPool();
+
+  void submit(Job job);
+  size_t size() const { return threads.size(); }
+  // Blocks until every submitted job has finished. A job that throws is
+  // finished; the first exception thrown since the last wait() is rethrown
+  // here, once the rest are done.
+  void wait();
+
+private:
+  struct Worker {
+    std::mutex lock;
+    std::deque<Job> jobs;
+  };
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::vector<std::thread> threads;
+  std::mutex idleLock;
+  std::condition_variable wakeup;
+  std::condition_variable drained;
+  std::atomic<size_t> pending;
+  std::atomic<size_t> queued;
+  std::atomic<size_t> nextWorker;
+  bool stopping;
+  std::exception_ptr failure;
+
+  void drain();
+  void work(size_t self);
+  bool take(size_t self, Job &job);
+};
+
+// Process-wide pool for data-parallel work that touches no interpreter state.
+WorkStealingPool &sharedPool();
+
+// Runs body(begin, end) over [0, n) in chunks of at least grain elements.
+// The calling thread works through chunks as well, so this can't deadlock
+// even when called from a pool worker.
+template <typename F> void parallelFor(size_t n, size_t grain, F body) {
+  struct State {
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> done{0};
+    std::mutex lock;
+    std::condition_variable finished;
+  };
+  size_t chunks = (n + grain - 1) / grain;
+  if (chunks <= 1) {
+    body(0, n);
+    return;
+  }
+  auto state = std::make_shared<State>();
+  auto work = [state, chunks, grain, n, &body] {
+    for (;;) {
+      size_t chunk = state->next++;
+      if (chunk >= chunks)
+        return;
+      size_t begin = chunk * grain;
+      body(begin, std::min(n, begin + grain));
+      if (++state->done == chunks) {
+        std::lock_guard<std::mutex> guard(state->lock);
+        state->finished.notify_all();
+      }
+    }
+  };
+  auto &pool = sharedPool();
+  size_t helpers = std::min(chunks, pool.size()) - 1;
+  for (size_t i = 0; i < helpers; i++) {
+    pool.submit([work] {
+      work();
+      return false;
+    });
+  }
+  work();
+  std::unique_lock<std::mutex> guard(state->lock);
+  state->finished.wait(guard, [&] { return state->done == chunks; });
+}
@@ -0,0 +1,9 @@
+#include "program.hpp"
+#include "parser.hpp"
+#include "scanner.hpp"
+
+Program::Program(std::string source) {
+  auto scanner = Scanner(std::move(source));
+  auto parser = Parser(scanner.scanTokens());
+  stmts = parser.parseProgram();
+}
@@ -0,0 +1,15 @@
+#pragma once
+#include "ast.hpp"
+#include <string>
+#include <vector>
+
+// A script that has been scanned and parsed. Programs are never modified after
+// construction, so one can be run any number of times, by any number of
+// Evaluators, without going back through the front-end.
+class Program {
+  std::vector<std::shared_ptr<Stmt>> stmts;
+
+public:
+  Program(std::string source);
+  const std::vector<std::shared_ptr<Stmt>> &statements() const { return stmts; }
+};
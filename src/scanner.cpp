@@ -10,8 +10,9 @@ constexpr bool is_alphanumeric(char ch) {
   return is_alpha(ch) || is_numeric(ch);
 }
 
-std::map<std::string, TokenType> keywords = {
-    {"and", TokenType::T_AND},       {"class", TokenType::T_CLASS},
+static const std::map<std::string, TokenType, std::less<>> keywords = {
+    {"and", TokenType::T_AND},       {"break", TokenType::T_BREAK},
+    {"class", TokenType::T_CLASS},   {"continue", TokenType::T_CONTINUE},
     {"else", TokenType::T_ELSE},     {"false", TokenType::T_FALSE},
     {"for", TokenType::T_FOR},       {"fun", TokenType::T_FUN},
     {"if", TokenType::T_IF},         {"nil", TokenType::T_NIL},
@@ -21,82 +22,118 @@ std::map<std::string, TokenType> keywords = {
     {"var", TokenType::T_VAR},       {"while", TokenType::T_WHILE},
 };
 
-Scanner::Scanner(std::string source) : source(source), current(0), start(0) {}
+Scanner::Scanner(std::string source)
+    : tokens{std::move(source), {}, {}, {}}, source(tokens.source), current(0),
+      start(0) {}
 
-std::vector<Token> &Scanner::scanTokens() {
+Scanner::Scanner(const std::string &source, size_t from)
+    : source(source), current(from), start(from) {}
+
+TokenStream &Scanner::scanTokens() try {
   while (!isAtEnd()) {
-    start = current;
-    auto token = advance();
-    switch (token) {
-    case '(':
-      addToken(TokenType::T_LEFT_PAREN);
-      break;
-    case ')':
-      addToken(TokenType::T_RIGHT_PAREN);
-      break;
-    case '{':
-      addToken(TokenType::T_LEFT_BRACE);
-      break;
-    case '}':
-      addToken(TokenType::T_RIGHT_BRACE);
-      break;
-    case ',':
-      addToken(TokenType::T_COMMA);
-      break;
-    case '.':
-      addToken(TokenType::T_DOT);
-      break;
-    case '+':
-      addToken(TokenType::T_PLUS);
-      break;
-    case '-':
-      addToken(TokenType::T_MINUS);
-      break;
-    case '*':
-      addToken(TokenType::T_STAR);
-      break;
-    case '!':
-      addToken(match('=') ? TokenType::T_BANG_EQUAL : TokenType::T_BANG);
-      break;
-    case '=':
-      addToken(match('=') ? TokenType::T_EQUAL_EQUAL : TokenType::T_EQUAL);
-      break;
-    case '<':
-      addToken(match('=') ? TokenType::T_LESS_EQUAL : TokenType::T_LESS);
-      break;
-    case '>':
-      addToken(match('=') ? TokenType::T_GREATER_EQUAL : TokenType::T_GREATER);
-      break;
-    case ';':
-      addToken(TokenType::T_SEMICOLON);
-      break;
-    case '/':
-      if (match('/')) {
-        while (peek() != '\n')
-          advance();
-        break;
-      }
-      addToken(TokenType::T_SLASH);
-    case '\n':
-      line += 1;
-    case ' ':
-    case '\t':
+    scan();
+  }
+  start = current;
+  addToken(TokenType::T_EOF);
+  return tokens;
+} catch (const char *e) {
+  throw ScriptError{e, start};
+}
+
+TokenType Scanner::next() try {
+  auto count = tokens.size();
+  while (tokens.size() == count) {
+    if (isAtEnd()) {
+      start = current;
+      addToken(TokenType::T_EOF);
       break;
-    case '"':
-      addString();
+    }
+    scan();
+  }
+  return tokens.types.back();
+} catch (const char *e) {
+  throw ScriptError{e, start};
+}
+
+// Scans from current up to the end of whatever starts there: a token, a
+// comment or one character of space.
+inline void Scanner::scan() {
+  start = current;
+  auto token = advance();
+  switch (token) {
+  case '(':
+    addToken(TokenType::T_LEFT_PAREN);
+    break;
+  case ')':
+    addToken(TokenType::T_RIGHT_PAREN);
+    break;
+  case '{':
+    addToken(TokenType::T_LEFT_BRACE);
+    break;
+  case '}':
+    addToken(TokenType::T_RIGHT_BRACE);
+    break;
+  case '[':
+    addToken(TokenType::T_LEFT_BRACKET);
+    break;
+  case ']':
+    addToken(TokenType::T_RIGHT_BRACKET);
+    break;
+  case ',':
+    addToken(TokenType::T_COMMA);
+    break;
+  case '.':
+    addToken(TokenType::T_DOT);
+    break;
+  case '+':
+    addToken(TokenType::T_PLUS);
+    break;
+  case '-':
+    addToken(TokenType::T_MINUS);
+    break;
+  case '*':
+    addToken(TokenType::T_STAR);
+    break;
+  case '!':
+    addToken(match('=') ? TokenType::T_BANG_EQUAL : TokenType::T_BANG);
+    break;
+  case '=':
+    addToken(match('=') ? TokenType::T_EQUAL_EQUAL : TokenType::T_EQUAL);
+    break;
+  case '<':
+    addToken(match('=') ? TokenType::T_LESS_EQUAL : TokenType::T_LESS);
+    break;
+  case '>':
+    addToken(match('=') ? TokenType::T_GREATER_EQUAL : TokenType::T_GREATER);
+    break;
+  case ';':
+    addToken(TokenType::T_SEMICOLON);
+    break;
+  case '/':
+    if (match('/')) {
+      while (!isAtEnd() && peek() != '\n')
+        advance();
       break;
-    default:
-      if (is_numeric(token)) {
-        addNumber();
-      } else if (is_alpha(token)) {
-        addIdentifier();
-      } else {
-        throw "Unknown token found";
-      }
+    }
+    addToken(TokenType::T_SLASH);
+    break;
+  case '\n':
+    line += 1;
+  case ' ':
+  case '\t':
+    break;
+  case '"':
+    addString();
+    break;
+  default:
+    if (is_numeric(token)) {
+      addNumber();
+    } else if (is_alpha(token)) {
+      addIdentifier();
+    } else {
+      throw "Unknown token found";
     }
   }
-  addToken(TokenType::T_EOF);
-  return tokens;
 }
 
 void Scanner::addNumber() {
@@ -113,21 +150,25 @@ void Scanner::addNumber() {
 void Scanner::addIdentifier() {
   while (is_alphanumeric(peek()))
     advance();
-  auto ident = source.substr(start, current - start);
-  if (keywords.count(ident) != 0)
-    addToken(keywords[ident]);
+  auto ident = std::string_view(source).substr(start, current - start);
+  auto kw = keywords.find(ident);
+  if (kw != keywords.end())
+    addToken(kw->second);
   else
     addToken(TokenType::T_IDENTIFIER);
 }
 
 void Scanner::addString() {
-  while (!isAtEnd() && !match('"'))
+  while (!match('"')) {
+    if (isAtEnd())
+      throw "Unterminated string";
     advance();
+  }
   addToken(TokenType::T_STRING);
 }
 
 void Scanner::addToken(TokenType type) {
-  tokens.push_back(Token{type, source.substr(start, current - start), start});
+  tokens.push(type, start, current - start);
 }
 
 char Scanner::peek() const { return source[current]; }
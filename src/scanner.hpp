@@ -3,19 +3,33 @@
 #include <string>
 #include <vector>
 
+#include "error.hpp"
 #include "token.hpp"
 
+// Not copyable or movable, since source may refer to the Scanner's own
+// tokens.source; move the stream out of scanTokens() instead.
 class Scanner {
-  std::string source;
-  std::vector<Token> tokens;
+  TokenStream tokens;
+  const std::string &source;
   size_t current, start;
   int line;
 
 public:
   Scanner(std::string);
-  std::vector<Token> &scanTokens();
+  Scanner(const Scanner &) = delete;
+  Scanner &operator=(const Scanner &) = delete;
+  // Scans a source the caller keeps alive, starting at from, which must not
+  // be inside a token, string or comment. Offsets are into that source, but
+  // the stream doesn't get a copy of it.
+  Scanner(const std::string &source, size_t from);
+  TokenStream &scanTokens();
+  // Scans the next token, skipping any space and comments before it, and
+  // returns its type. At the end of the source that's T_EOF.
+  TokenType next();
+  TokenStream &scanned() { return tokens; }
 
 private:
+  void scan();
   void addToken(TokenType);
   void addNumber();
   void addIdentifier();
@@ -0,0 +1,155 @@
+#include "interpreter.hpp"
+
+// Thrown inside a task that is being torn down, so its interpreter frames
+// unwind normally before the fiber goes away.
+struct TaskCancelled {};
+
+static void nativeSpawn(Evaluator &eval, std::shared_ptr<Function> fn) {
+  eval.spawn(std::move(fn));
+}
+static void nativeYield(Evaluator &eval) { eval.yield(); }
+static std::shared_ptr<Channel> nativeChannel(Evaluator &eval) {
+  return eval.channel();
+}
+static void nativeSend(Evaluator &eval, std::shared_ptr<Channel> ch,
+                       Value val) {
+  eval.send(*ch, std::move(val));
+}
+static Value nativeReceive(Evaluator &eval, std::shared_ptr<Channel> ch) {
+  return eval.receive(*ch);
+}
+
+void Evaluator::defineTaskNatives() {
+  defineNative("spawn", nativeSpawn);
+  defineNative("yield", nativeYield);
+  defineNative("channel", nativeChannel);
+  defineNative("send", nativeSend);
+  defineNative("receive", nativeReceive);
+}
+
+void Evaluator::spawn(std::shared_ptr<Function> fn) {
+  checkArity(*fn, 0);
+  spawnTask([this, fn] { call(*fn, nullptr, 0); });
+}
+
+void Evaluator::start(const Program &program) {
+  spawnTask([this, &program] { run(program.statements()); });
+}
+
+void Evaluator::spawnTask(std::function<void()> body) {
+  auto task = make<Task>([this] { taskMain(); }, std::move(body));
+  task->vars = globals;
+  task->slot = tasks.size();
+  tasks.push_back(task);
+  ready.push_back(std::move(task));
+}
+
+void Evaluator::taskMain() {
+  auto task = current;
+  if (task->cancelled)
+    return;
+  try {
+    task->body();
+  } catch (const ScriptError &e) {
+    task->error = e;
+  } catch (const char *e) {
+    task->error = {e, ScriptError::NO_POSITION};
+  } catch (const TaskCancelled &) {
+  } catch (...) {
+    task->error = {"Task failed", ScriptError::NO_POSITION};
+  }
+}
+
+void Evaluator::yield() {
+  if (current != nullptr) {
+    ready.push_back(tasks[current->slot]);
+    suspendCurrent();
+    return;
+  }
+  for (auto n = ready.size(); n > 0 && !ready.empty(); n--) {
+    runOne();
+  }
+}
+
+std::shared_ptr<Channel> Evaluator::channel() { return make<Channel>(); }
+
+void Evaluator::send(Channel &ch, Value val) {
+  ch.buffer.push_back(std::move(val));
+  if (!ch.receivers.empty()) {
+    ready.push_back(std::move(ch.receivers.front()));
+    ch.receivers.pop_front();
+  }
+}
+
+Value Evaluator::receive(Channel &ch) {
+  while (ch.buffer.empty()) {
+    if (current != nullptr) {
+      ch.receivers.push_back(tasks[current->slot]);
+      suspendCurrent();
+    } else {
+      if (ready.empty())
+        throw "Deadlock: every task is waiting on a channel";
+      runOne();
+    }
+  }
+  auto val = std::move(ch.buffer.front());
+  ch.buffer.pop_front();
+  return val;
+}
+
+void Evaluator::runTasks() {
+  while (!ready.empty()) {
+    runOne();
+  }
+}
+
+bool Evaluator::runSlice(size_t n) {
+  for (; n > 0 && !ready.empty(); n--) {
+    runOne();
+  }
+  return !ready.empty();
+}
+
+void Evaluator::runOne() {
+  auto task = std::move(ready.front());
+  ready.pop_front();
+  resumeTask(std::move(task));
+}
+
+// Tasks are only ever resumed from outside any task, and they always
+// suspend back to it, so the scheduler never nests.
+void Evaluator::resumeTask(std::shared_ptr<Task> task) {
+  if (task->fiber.done())
+    return;
+  current = task.get();
+  std::swap(vars, task->vars);
+  std::swap(depth, task->depth);
+  task->fiber.resume();
+  std::swap(depth, task->depth);
+  std::swap(vars, task->vars);
+  current = nullptr;
+  if (!task->fiber.done())
+    return;
+  tasks[task->slot] = std::move(tasks.back());
+  tasks[task->slot]->slot = task->slot;
+  tasks.pop_back();
+  task->vars = nullptr;
+  if (task->error.message != nullptr && !task->cancelled)
+    throw task->error;
+}
+
+void Evaluator::suspendCurrent() {
+  auto task = current;
+  task->fiber.suspend();
+  if (task->cancelled)
+    throw TaskCancelled();
+}
+
+void Evaluator::cancelTasks() {
+  ready.clear();
+  while (!tasks.empty()) {
+    auto task = tasks.back();
+    task->cancelled = true;
+    resumeTask(task);
+  }
+}
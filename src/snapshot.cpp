@@ -0,0 +1,674 @@
+#include "array.hpp"
+#include "interpreter.hpp"
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+
+// Image layout, in the byte order of the machine that wrote it:
+//
+//   header    magic, version, byte order mark, object count, global scope
+//   offsets   one u64 per object: where in the image its record starts
+//   records   a tag byte, then the object's contents
+//
+// Objects refer to each other by index, never by address, so an image can be
+// mapped anywhere and loaded into any Evaluator. Function declarations are
+// objects too and carry their AST, so an image doesn't need the source it
+// came from. Natives are written by name and bound to the loader's own.
+
+static const char MAGIC[8] = {'L', 'O', 'X', 'S', 'N', 'A', 'P', 0};
+static constexpr uint32_t VERSION = 1;
+static constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+static constexpr size_t HEADER_SIZE = sizeof(MAGIC) + 4 * sizeof(uint32_t);
+static constexpr uint32_t NONE = UINT32_MAX;
+// In place of a node kind, for an absent child.
+static constexpr uint8_t NO_NODE = 0xff;
+
+enum class Tag : uint8_t {
+  SCOPE,
+  FUNCTION,
+  NATIVE,
+  STRING,
+  ARRAY,
+  LIST,
+  DICT,
+  CHANNEL,
+  FUN
+};
+
+// Strings in AST literals are written inline rather than as objects: they
+// belong to the AST, not to an isolate's heap.
+enum class ValueTag : uint8_t { NIL, FALSE, TRUE, INT, DOUBLE, REF, LITERAL };
+
+class SnapshotWriter : StmtVisitor<SnapshotWriter, void>,
+                       ExprVisitor<SnapshotWriter, void> {
+  friend StmtVisitor<SnapshotWriter, void>;
+  friend ExprVisitor<SnapshotWriter, void>;
+  using StmtVisitor<SnapshotWriter, void>::visit;
+  using ExprVisitor<SnapshotWriter, void>::visit;
+
+  struct Object {
+    Tag tag;
+    const void *ptr;
+  };
+  std::string records;
+  std::unordered_map<const void *, uint32_t> ids;
+  std::vector<Object> objects;
+
+public:
+  std::string write(const std::shared_ptr<Scope<Value>> &globals) {
+    auto root = ref(Tag::SCOPE, globals.get());
+    std::vector<uint64_t> offsets;
+    // Writing a record can turn up more objects, which join the end of the
+    // queue and are written in turn.
+    for (size_t i = 0; i < objects.size(); i++) {
+      offsets.push_back(records.size());
+      record(objects[i]);
+    }
+    uint32_t count = objects.size();
+    auto base = HEADER_SIZE + count * sizeof(uint64_t);
+    std::string image(MAGIC, sizeof(MAGIC));
+    put(image, VERSION);
+    put(image, BYTE_ORDER_MARK);
+    put(image, count);
+    put(image, root);
+    for (auto offset : offsets) {
+      put(image, uint64_t(base + offset));
+    }
+    return image + records;
+  }
+
+private:
+  template <typename T> static void put(std::string &to, T val) {
+    static_assert(std::is_arithmetic_v<T> || std::is_enum_v<T>);
+    to.append(reinterpret_cast<const char *>(&val), sizeof(val));
+  }
+  template <typename T> void put(T val) { put(records, val); }
+  void chars(std::string_view chars) {
+    put(uint64_t(chars.size()));
+    records.append(chars.data(), chars.size());
+  }
+
+  uint32_t ref(Tag tag, const void *ptr) {
+    auto found = ids.find(ptr);
+    if (found != ids.end())
+      return found->second;
+    uint32_t id = objects.size();
+    ids.emplace(ptr, id);
+    objects.push_back({tag, ptr});
+    return id;
+  }
+  uint32_t ref(const std::shared_ptr<Scope<Value>> &scope) {
+    return scope != nullptr ? ref(Tag::SCOPE, scope.get()) : NONE;
+  }
+
+  void value(const Value &val) {
+    if (std::holds_alternative<std::nullptr_t>(val)) {
+      put(ValueTag::NIL);
+    } else if (auto b = std::get_if<bool>(&val)) {
+      put(*b ? ValueTag::TRUE : ValueTag::FALSE);
+    } else if (auto i = std::get_if<int64_t>(&val)) {
+      put(ValueTag::INT);
+      put(*i);
+    } else if (auto d = std::get_if<double>(&val)) {
+      put(ValueTag::DOUBLE);
+      put(*d);
+    } else {
+      put(ValueTag::REF);
+      put(std::visit(
+          [this](auto &ptr) -> uint32_t {
+            using P = std::decay_t<decltype(ptr)>;
+            if constexpr (std::is_same_v<P, std::shared_ptr<Function>>)
+              return ref(Tag::FUNCTION, ptr.get());
+            else if constexpr (std::is_same_v<P, std::shared_ptr<Native>>)
+              return ref(Tag::NATIVE, ptr.get());
+            else if constexpr (std::is_same_v<P, std::shared_ptr<String>>)
+              return ref(Tag::STRING, ptr.get());
+            else if constexpr (std::is_same_v<P, std::shared_ptr<Array>>)
+              return ref(Tag::ARRAY, ptr.get());
+            else if constexpr (std::is_same_v<P, std::shared_ptr<List>>)
+              return ref(Tag::LIST, ptr.get());
+            else if constexpr (std::is_same_v<P, std::shared_ptr<Dict>>)
+              return ref(Tag::DICT, ptr.get());
+            else if constexpr (std::is_same_v<P, std::shared_ptr<Channel>>)
+              return ref(Tag::CHANNEL, ptr.get());
+            else
+              return NONE;
+          },
+          val));
+    }
+  }
+
+  void record(Object obj) {
+    put(obj.tag);
+    switch (obj.tag) {
+    case Tag::SCOPE: {
+      auto scope = static_cast<const Scope<Value> *>(obj.ptr);
+      put(ref(scope->outer()));
+      uint32_t count = 0;
+      scope->forEach([&count](std::string_view, const Value &) {
+        count++;
+      });
+      put(count);
+      scope->forEach([this](std::string_view name, const Value &val) {
+        chars(name);
+        value(val);
+      });
+      break;
+    }
+    case Tag::FUNCTION: {
+      auto fn = static_cast<const Function *>(obj.ptr);
+      put(ref(Tag::FUN, fn->decl.get()));
+      put(ref(fn->closure));
+      break;
+    }
+    case Tag::NATIVE:
+      chars(static_cast<const Native *>(obj.ptr)->name);
+      break;
+    case Tag::STRING:
+      chars(static_cast<const String *>(obj.ptr)->view());
+      break;
+    case Tag::ARRAY: {
+      auto &data = static_cast<const Array *>(obj.ptr)->data;
+      chars(std::string_view(reinterpret_cast<const char *>(data.data()),
+                             data.size() * sizeof(double)));
+      break;
+    }
+    case Tag::LIST: {
+      auto list = static_cast<const List *>(obj.ptr);
+      put(uint8_t(list->builder.has_value()));
+      put(uint64_t(list->size()));
+      for (size_t i = 0; i < list->size(); i++) {
+        value((*list)[i]);
+      }
+      break;
+    }
+    case Tag::DICT: {
+      auto dict = const_cast<Dict *>(static_cast<const Dict *>(obj.ptr));
+      put(uint8_t(dict->builder.has_value()));
+      put(uint64_t(dict->size()));
+      auto items = dict->builder ? dict->builder->persistent() : dict->items;
+      items.forEach([this](const Value &key, const Value &val) {
+        value(key);
+        value(val);
+      });
+      break;
+    }
+    case Tag::CHANNEL: {
+      auto &buffer = static_cast<const Channel *>(obj.ptr)->buffer;
+      put(uint64_t(buffer.size()));
+      for (auto &val : buffer) {
+        value(val);
+      }
+      break;
+    }
+    case Tag::FUN: {
+      auto fun = static_cast<const Fun *>(obj.ptr);
+      chars(fun->name);
+      put(uint32_t(fun->bindings.size()));
+      for (auto &name : fun->bindings) {
+        chars(name);
+      }
+      stmts(fun->body);
+      break;
+    }
+    }
+  }
+
+  void stmts(const std::vector<std::shared_ptr<Stmt>> &list) {
+    put(uint32_t(list.size()));
+    for (auto &stmt : list) {
+      node(stmt);
+    }
+  }
+  void node(const std::shared_ptr<Stmt> &stmt) {
+    if (stmt == nullptr)
+      return put(NO_NODE);
+    put(uint8_t(stmt->kind));
+    visit(*stmt);
+  }
+  void node(const std::shared_ptr<Expr> &expr) {
+    if (expr == nullptr)
+      return put(NO_NODE);
+    put(uint8_t(expr->kind));
+    visit(*expr);
+  }
+
+  void visitBinop(const Binop &node) {
+    put(uint8_t(node.op));
+    this->node(node.lhs);
+    this->node(node.rhs);
+  }
+  void visitVariable(const Variable &node) { chars(node.ident); }
+  void visitCall(const Call &node) {
+    this->node(node.callee);
+    put(uint32_t(node.args.size()));
+    for (auto &arg : node.args) {
+      this->node(arg);
+    }
+  }
+  void visitIndex(const Index &node) {
+    this->node(node.object);
+    this->node(node.index);
+  }
+  void visitLiteral(const Literal &node) {
+    if (auto str = std::get_if<std::shared_ptr<String>>(&node.value)) {
+      put(ValueTag::LITERAL);
+      chars((*str)->view());
+    } else {
+      value(node.value);
+    }
+  }
+  void visitUnop(const Unop &node) {
+    put(uint8_t(node.op));
+    this->node(node.rhs);
+  }
+  void visitExpressionStmt(const ExpressionStmt &node) {
+    this->node(node.expr);
+  }
+  void visitWhile(const While &node) {
+    this->node(node.cond);
+    this->node(node.body);
+  }
+  void visitIf(const If &node) {
+    this->node(node.cond);
+    this->node(node.ifTrue);
+    this->node(node.ifFalse);
+  }
+  // A nested declaration is its own object, shared with every closure made
+  // from it.
+  void visitFun(const Fun &node) { put(ref(Tag::FUN, &node)); }
+  void visitReturn(const Return &node) { this->node(node.value); }
+  void visitBreak(const Break &) {}
+  void visitContinue(const Continue &) {}
+  void visitPrint(const Print &node) { this->node(node.expr); }
+  void visitBlock(const Block &node) { stmts(node.stmts); }
+  void visitVarDecl(const VarDecl &node) {
+    chars(node.ident);
+    this->node(node.init);
+  }
+};
+
+// Every object is created before any is filled in, so references may point
+// forward and cycles need no special handling. Reads are bounds-checked and
+// references type-checked, so a damaged image fails to load rather than
+// crashing later.
+class SnapshotReader {
+  struct Object {
+    Tag tag;
+    uint64_t offset;
+    Value value;
+    std::shared_ptr<Scope<Value>> scope;
+    std::shared_ptr<Fun> fun;
+  };
+  Evaluator &eval;
+  const char *begin;
+  const char *pos;
+  const char *end;
+  std::vector<Object> objects;
+
+public:
+  SnapshotReader(Evaluator &eval, const char *image, size_t size)
+      : eval(eval), begin(image), pos(image), end(image + size) {}
+
+  std::shared_ptr<Scope<Value>> read() {
+    need(HEADER_SIZE);
+    if (memcmp(pos, MAGIC, sizeof(MAGIC)) != 0)
+      throw "Not a snapshot";
+    pos += sizeof(MAGIC);
+    if (get<uint32_t>() != VERSION || get<uint32_t>() != BYTE_ORDER_MARK)
+      throw "Snapshot is from an incompatible build";
+    auto count = get<uint32_t>();
+    auto root = get<uint32_t>();
+    need(uint64_t(count) * sizeof(uint64_t));
+    objects.resize(count);
+    for (auto &obj : objects) {
+      obj.offset = get<uint64_t>();
+    }
+    for (auto &obj : objects) {
+      seek(obj.offset);
+      create(obj);
+    }
+    try {
+      for (auto &obj : objects) {
+        seek(obj.offset + 1);
+        fill(obj);
+      }
+      return object(root, Tag::SCOPE).scope;
+    } catch (...) {
+      discard();
+      throw;
+    }
+  }
+
+private:
+  void need(uint64_t n) {
+    if (uint64_t(end - pos) < n)
+      throw "Snapshot is truncated";
+  }
+  void seek(uint64_t offset) {
+    if (offset >= uint64_t(end - begin))
+      throw "Snapshot is corrupt";
+    pos = begin + offset;
+  }
+  template <typename T> T get() {
+    need(sizeof(T));
+    T val;
+    memcpy(&val, pos, sizeof(T));
+    pos += sizeof(T);
+    return val;
+  }
+  std::string_view bytes() {
+    auto n = get<uint64_t>();
+    need(n);
+    auto chars = std::string_view(pos, n);
+    pos += n;
+    return chars;
+  }
+  Object &object(uint32_t index, Tag tag) {
+    if (index >= objects.size() || objects[index].tag != tag)
+      throw "Snapshot is corrupt";
+    return objects[index];
+  }
+  std::shared_ptr<Scope<Value>> scope() {
+    auto index = get<uint32_t>();
+    return index != NONE ? object(index, Tag::SCOPE).scope : nullptr;
+  }
+
+  void create(Object &obj) {
+    obj.tag = Tag(get<uint8_t>());
+    switch (obj.tag) {
+    case Tag::SCOPE:
+      obj.scope = eval.make<Scope<Value>>(&eval.heap);
+      break;
+    case Tag::FUNCTION:
+      obj.value = eval.make<Function>(Function{nullptr, nullptr});
+      break;
+    case Tag::NATIVE: {
+      auto found = eval.globals->find(std::string(bytes()));
+      if (found == nullptr ||
+          !std::holds_alternative<std::shared_ptr<Native>>(*found))
+        throw "Snapshot uses a native this Evaluator doesn't have";
+      obj.value = *found;
+      break;
+    }
+    case Tag::STRING:
+      obj.value = eval.string(bytes());
+      break;
+    case Tag::ARRAY: {
+      auto data = bytes();
+      if (data.size() % sizeof(double) != 0)
+        throw "Snapshot is corrupt";
+      auto array = eval.array(data.size() / sizeof(double));
+      memcpy(array->data.data(), data.data(), data.size());
+      obj.value = array;
+      break;
+    }
+    case Tag::LIST:
+      obj.value = eval.list(eval.emptyVector());
+      break;
+    case Tag::DICT:
+      obj.value = eval.dict(eval.emptyMap());
+      break;
+    case Tag::CHANNEL:
+      obj.value = eval.channel();
+      break;
+    case Tag::FUN:
+      obj.fun = std::make_shared<Fun>(std::string(), std::vector<std::string>(),
+                                      std::vector<std::shared_ptr<Stmt>>());
+      break;
+    default:
+      throw "Snapshot is corrupt";
+    }
+  }
+
+  void fill(Object &obj) {
+    switch (obj.tag) {
+    case Tag::SCOPE: {
+      obj.scope->reset(scope());
+      auto count = get<uint32_t>();
+      for (uint32_t i = 0; i < count; i++) {
+        auto name = std::string(bytes());
+        obj.scope->insert(name, value());
+      }
+      break;
+    }
+    case Tag::FUNCTION: {
+      auto &fn = std::get<std::shared_ptr<Function>>(obj.value);
+      fn->decl = object(get<uint32_t>(), Tag::FUN).fun;
+      fn->closure = scope();
+      if (fn->closure == nullptr)
+        throw "Snapshot is corrupt";
+      break;
+    }
+    case Tag::LIST: {
+      auto &list = std::get<std::shared_ptr<List>>(obj.value);
+      bool building = get<uint8_t>();
+      PVector::Transient items{eval.emptyVector()};
+      for (auto n = get<uint64_t>(); n > 0; n--) {
+        items.push(value());
+      }
+      list->items = items.persistent();
+      if (building)
+        list->builder.emplace(list->items);
+      break;
+    }
+    case Tag::DICT: {
+      auto &dict = std::get<std::shared_ptr<Dict>>(obj.value);
+      bool building = get<uint8_t>();
+      PMap::Transient items{eval.emptyMap()};
+      for (auto n = get<uint64_t>(); n > 0; n--) {
+        auto key = value();
+        items.insert(std::move(key), value());
+      }
+      dict->items = items.persistent();
+      if (building)
+        dict->builder.emplace(dict->items);
+      break;
+    }
+    case Tag::CHANNEL: {
+      auto &channel = std::get<std::shared_ptr<Channel>>(obj.value);
+      for (auto n = get<uint64_t>(); n > 0; n--) {
+        channel->buffer.push_back(value());
+      }
+      break;
+    }
+    case Tag::FUN: {
+      auto &fun = *obj.fun;
+      fun.name = std::string(bytes());
+      for (auto n = get<uint32_t>(); n > 0; n--) {
+        fun.bindings.push_back(std::string(bytes()));
+      }
+      fun.body = stmts();
+      break;
+    }
+    default:
+      break;
+    }
+  }
+
+  // A half-loaded graph can already have cycles in it; cut them so the
+  // objects are freed.
+  void discard() {
+    for (auto &obj : objects) {
+      if (obj.scope != nullptr)
+        obj.scope->reset(nullptr);
+      if (auto fn = std::get_if<std::shared_ptr<Function>>(&obj.value))
+        (*fn)->closure = nullptr;
+      if (auto list = std::get_if<std::shared_ptr<List>>(&obj.value)) {
+        (*list)->builder.reset();
+        (*list)->items = PVector();
+      }
+      if (auto dict = std::get_if<std::shared_ptr<Dict>>(&obj.value)) {
+        (*dict)->builder.reset();
+        (*dict)->items = PMap();
+      }
+      if (auto channel = std::get_if<std::shared_ptr<Channel>>(&obj.value))
+        (*channel)->buffer.clear();
+      if (obj.fun != nullptr)
+        obj.fun->body.clear();
+    }
+  }
+
+  Value value() {
+    switch (ValueTag(get<uint8_t>())) {
+    case ValueTag::NIL:
+      return nullptr;
+    case ValueTag::FALSE:
+      return false;
+    case ValueTag::TRUE:
+      return true;
+    case ValueTag::INT:
+      return get<int64_t>();
+    case ValueTag::DOUBLE:
+      return get<double>();
+    case ValueTag::REF: {
+      auto index = get<uint32_t>();
+      if (index >= objects.size() || objects[index].tag == Tag::SCOPE ||
+          objects[index].tag == Tag::FUN)
+        throw "Snapshot is corrupt";
+      return objects[index].value;
+    }
+    case ValueTag::LITERAL:
+      return std::make_shared<String>(bytes());
+    }
+    throw "Snapshot is corrupt";
+  }
+
+  std::vector<std::shared_ptr<Stmt>> stmts() {
+    std::vector<std::shared_ptr<Stmt>> list;
+    for (auto n = get<uint32_t>(); n > 0; n--) {
+      list.push_back(stmt());
+    }
+    return list;
+  }
+  std::shared_ptr<Stmt> stmt(bool optional = false) {
+    auto kind = get<uint8_t>();
+    if (kind == NO_NODE && optional)
+      return nullptr;
+    switch (StmtKind(kind)) {
+    case StmtKind::ExpressionStmt:
+      return std::make_shared<ExpressionStmt>(expr());
+    case StmtKind::While: {
+      auto cond = expr();
+      return std::make_shared<While>(cond, stmt());
+    }
+    case StmtKind::If: {
+      auto cond = expr();
+      auto ifTrue = stmt();
+      return std::make_shared<If>(cond, ifTrue, stmt(true));
+    }
+    case StmtKind::Fun:
+      return object(get<uint32_t>(), Tag::FUN).fun;
+    case StmtKind::Return:
+      return std::make_shared<Return>(expr(true));
+    case StmtKind::Break:
+      return std::make_shared<Break>();
+    case StmtKind::Continue:
+      return std::make_shared<Continue>();
+    case StmtKind::Print:
+      return std::make_shared<Print>(expr());
+    case StmtKind::Block:
+      return std::make_shared<Block>(stmts());
+    case StmtKind::VarDecl: {
+      auto ident = std::string(bytes());
+      return std::make_shared<VarDecl>(ident, expr(true));
+    }
+    }
+    throw "Snapshot is corrupt";
+  }
+  // Positions were offsets into a source that isn't around any more.
+  template <typename T> std::shared_ptr<Expr> at(std::shared_ptr<T> node) {
+    node->pos = ScriptError::NO_POSITION;
+    return node;
+  }
+  std::shared_ptr<Expr> expr(bool optional = false) {
+    auto kind = get<uint8_t>();
+    if (kind == NO_NODE && optional)
+      return nullptr;
+    switch (ExprKind(kind)) {
+    case ExprKind::Binop: {
+      auto op = get<uint8_t>();
+      if (op > uint8_t(BinopType::ASSIGN))
+        break;
+      auto lhs = expr();
+      return at(std::make_shared<Binop>(BinopType(op), lhs, expr()));
+    }
+    case ExprKind::Variable:
+      return at(std::make_shared<Variable>(std::string(bytes())));
+    case ExprKind::Call: {
+      auto callee = expr();
+      std::vector<std::shared_ptr<Expr>> args;
+      for (auto n = get<uint32_t>(); n > 0; n--) {
+        args.push_back(expr());
+      }
+      return at(std::make_shared<Call>(callee, args));
+    }
+    case ExprKind::Index: {
+      auto object = expr();
+      return at(std::make_shared<Index>(object, expr()));
+    }
+    case ExprKind::Literal:
+      return at(std::make_shared<Literal>(value()));
+    case ExprKind::Unop: {
+      auto op = get<uint8_t>();
+      if (op > uint8_t(UnopType::NOT))
+        break;
+      return at(std::make_shared<Unop>(UnopType(op), expr()));
+    }
+    }
+    throw "Snapshot is corrupt";
+  }
+};
+
+// Read-only mapping of a whole file.
+class MappedFile {
+  void *data;
+  size_t size;
+
+public:
+  MappedFile(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw "Can't open snapshot";
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+      close(fd);
+      throw "Not a snapshot";
+    }
+    size = st.st_size;
+    data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+      throw "Can't map snapshot";
+  }
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+  ~MappedFile() { munmap(data, size); }
+
+  const char *bytes() const { return static_cast<const char *>(data); }
+  size_t length() const { return size; }
+};
+
+void Evaluator::saveSnapshot(const std::string &path) {
+  if (!tasks.empty())
+    throw "Can't snapshot while tasks are running";
+  auto image = SnapshotWriter().write(globals);
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  file.write(image.data(), image.size());
+  if (!file)
+    throw "Can't write snapshot";
+}
+
+void Evaluator::loadSnapshot(const std::string &path) {
+  if (!tasks.empty())
+    throw "Can't load a snapshot while tasks are running";
+  MappedFile file(path);
+  auto loaded = SnapshotReader(*this, file.bytes(), file.length()).read();
+  globals->reset(nullptr);
+  globals = std::move(loaded);
+  vars = globals;
+}
@@ -0,0 +1,186 @@
+#include "stats.hpp"
+#include <atomic>
+#include <cstdlib>
+#include <ctime>
+#include <iomanip>
+#include <linux/perf_event.h>
+#include <new>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static std::atomic<bool> counting(false);
+static std::atomic<uint64_t> allocationCount(0);
+static std::atomic<uint64_t> allocationBytes(0);
+
+void *operator new(size_t size) {
+  if (counting.load(std::memory_order_relaxed)) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    allocationBytes.fetch_add(size, std::memory_order_relaxed);
+  }
+  if (auto ptr = malloc(size != 0 ? size : 1))
+    return ptr;
+  throw std::bad_alloc();
+}
+void operator delete(void *ptr) noexcept { free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+
+static double seconds(clockid_t clock) {
+  timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int openCounter(uint64_t config, int group) {
+  perf_event_attr attr = {};
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = config;
+  attr.disabled = group == -1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+Stats::Stats() : group(-1), fds{-1, -1, -1, -1}, current(nullptr) {
+  const uint64_t events[COUNTERS] = {
+      PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+      PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+  for (size_t i = 0; i < COUNTERS; i++) {
+    fds[i] = openCounter(events[i], fds[0]);
+    if (fds[i] == -1)
+      break;
+  }
+  if (fds[COUNTERS - 1] != -1) {
+    group = fds[0];
+  } else {
+    // Not permitted, or no PMU (as in many VMs): fall back to the clocks.
+    for (auto fd : fds) {
+      if (fd != -1)
+        close(fd);
+    }
+  }
+  counting = true;
+}
+
+Stats::~Stats() {
+  counting = false;
+  if (group != -1) {
+    for (auto fd : fds) {
+      close(fd);
+    }
+  }
+}
+
+void Stats::begin(const std::string &name, Heap::Totals heap) {
+  current = nullptr;
+  for (auto &phase : phases) {
+    if (phase.name == name)
+      current = &phase;
+  }
+  if (current == nullptr) {
+    phases.push_back(Phase());
+    current = &phases.back();
+    current->name = name;
+  }
+  heapStart = heap;
+  allocationsStart = allocationCount;
+  bytesStart = allocationBytes;
+  cpuStart = seconds(CLOCK_PROCESS_CPUTIME_ID);
+  wallStart = seconds(CLOCK_MONOTONIC);
+  if (group != -1) {
+    ioctl(group, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(group, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+}
+
+void Stats::end(Heap::Totals heap) {
+  if (group != -1) {
+    ioctl(group, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    uint64_t values[COUNTERS];
+    readCounters(values);
+    current->cycles += values[0];
+    current->instructions += values[1];
+    current->cacheMisses += values[2];
+    current->branchMisses += values[3];
+  }
+  current->wallSeconds += seconds(CLOCK_MONOTONIC) - wallStart;
+  current->cpuSeconds += seconds(CLOCK_PROCESS_CPUTIME_ID) - cpuStart;
+  current->allocations += allocationCount - allocationsStart +
+                          heap.allocations - heapStart.allocations;
+  current->bytes +=
+      allocationBytes - bytesStart + heap.bytes - heapStart.bytes;
+  current = nullptr;
+}
+
+void Stats::readCounters(uint64_t (&values)[COUNTERS]) const {
+  struct {
+    uint64_t count;
+    uint64_t values[COUNTERS];
+  } reading = {};
+  if (read(group, &reading, sizeof(reading)) != sizeof(reading))
+    reading = {};
+  for (size_t i = 0; i < COUNTERS; i++) {
+    values[i] = reading.values[i];
+  }
+}
+
+static double ipc(const Stats::Phase &phase) {
+  return phase.cycles != 0 ? double(phase.instructions) / phase.cycles : 0;
+}
+
+void Stats::writeText(std::ostream &os) const {
+  auto flags = os.flags();
+  auto precision = os.precision();
+  os << std::left << std::setw(8) << "phase" << std::right << std::setw(11)
+     << "wall ms" << std::setw(11) << "cpu ms" << std::setw(12) << "allocs"
+     << std::setw(14) << "bytes";
+  if (hasCounters())
+    os << std::setw(15) << "cycles" << std::setw(15) << "instructions"
+       << std::setw(6) << "IPC" << std::setw(13) << "cache miss"
+       << std::setw(13) << "branch miss";
+  os << "\n";
+  for (auto &phase : phases) {
+    os << std::left << std::setw(8) << phase.name << std::right << std::fixed
+       << std::setprecision(3) << std::setw(11) << phase.wallSeconds * 1e3
+       << std::setw(11) << phase.cpuSeconds * 1e3 << std::setw(12)
+       << phase.allocations << std::setw(14) << phase.bytes;
+    if (hasCounters())
+      os << std::setw(15) << phase.cycles << std::setw(15)
+         << phase.instructions << std::setw(6) << std::setprecision(2)
+         << ipc(phase) << std::setw(13) << phase.cacheMisses << std::setw(13)
+         << phase.branchMisses;
+    os << "\n";
+  }
+  if (!hasCounters())
+    os << "(hardware counters unavailable; times from clock_gettime)\n";
+  os.flags(flags);
+  os.precision(precision);
+}
+
+void Stats::writeJson(std::ostream &os) const {
+  auto flags = os.flags();
+  auto precision = os.precision();
+  os << "{\"counters\": " << (hasCounters() ? "true" : "false")
+     << ", \"phases\": [";
+  bool first = true;
+  for (auto &phase : phases) {
+    os << (first ? "" : ", ") << "{\"name\": \"" << phase.name << "\""
+       << std::setprecision(9) << ", \"wall_seconds\": " << phase.wallSeconds
+       << ", \"cpu_seconds\": " << phase.cpuSeconds
+       << ", \"allocations\": " << phase.allocations
+       << ", \"bytes\": " << phase.bytes;
+    if (hasCounters())
+      os << ", \"cycles\": " << phase.cycles
+         << ", \"instructions\": " << phase.instructions
+         << ", \"ipc\": " << ipc(phase)
+         << ", \"cache_misses\": " << phase.cacheMisses
+         << ", \"branch_misses\": " << phase.branchMisses;
+    os << "}";
+    first = false;
+  }
+  os << "]}\n";
+  os.flags(flags);
+  os.precision(precision);
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include "heap.hpp"
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Per-phase measurements for --stats. Each phase gets wall and CPU time, the
+// allocations made through operator new (and, where the caller passes them
+// in, an isolate Heap's), and, when the kernel lets us open them, hardware
+// counters for the calling thread: cycles, instructions, cache misses and
+// branch misses. Without perf_event_open access only the times and
+// allocation counts are reported.
+//
+// Linking this file replaces the global operator new so allocations can be
+// counted; counting costs nothing until a Stats object exists.
+class Stats {
+public:
+  struct Phase {
+    std::string name;
+    double wallSeconds = 0;
+    double cpuSeconds = 0;
+    uint64_t cycles = 0;
+    uint64_t instructions = 0;
+    uint64_t cacheMisses = 0;
+    uint64_t branchMisses = 0;
+    uint64_t allocations = 0;
+    uint64_t bytes = 0;
+  };
+
+  Stats();
+  Stats(const Stats &) = delete;
+  Stats &operator=(const Stats &) = delete;
+  ~Stats();
+
+  bool hasCounters() const { return group != -1; }
+  // Measures from begin() to end(). Measuring a phase again adds to it.
+  // heap is the Heap totals at the time of the call, if the phase
+  // allocates from one.
+  void begin(const std::string &name, Heap::Totals heap = {0, 0});
+  void end(Heap::Totals heap = {0, 0});
+
+  void writeText(std::ostream &os) const;
+  void writeJson(std::ostream &os) const;
+
+private:
+  static constexpr size_t COUNTERS = 4;
+  int group;
+  int fds[COUNTERS];
+  std::vector<Phase> phases;
+  // Readings taken at begin().
+  Phase *current;
+  double wallStart, cpuStart;
+  uint64_t allocationsStart, bytesStart;
+  Heap::Totals heapStart;
+
+  void readCounters(uint64_t (&values)[COUNTERS]) const;
+};
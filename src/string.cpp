@@ -0,0 +1,110 @@
+#include "string.hpp"
+#include <cstring>
+#include <functional>
+#include <vector>
+
+String::String(std::string_view chars, Heap *heap)
+    : length(chars.size()), cachedHash(0), heap(heap), chars(inlineChars) {
+  if (length > INLINE_CAPACITY) {
+    if (heap != nullptr)
+      heap->charge(length);
+    outOfLine = std::make_unique<char[]>(length);
+    this->chars = outOfLine.get();
+  }
+  memcpy(const_cast<char *>(this->chars), chars.data(), length);
+}
+
+String::String(std::shared_ptr<String> left, std::shared_ptr<String> right,
+               Heap *heap)
+    : length(left->size() + right->size()), cachedHash(0), heap(heap),
+      chars(nullptr), left(std::move(left)), right(std::move(right)) {}
+
+String::String(std::shared_ptr<String> whole, size_t offset, size_t length,
+               Heap *heap)
+    : length(length), cachedHash(0), heap(heap), chars(inlineChars) {
+  auto from = whole->view().data() + offset;
+  if (length <= INLINE_CAPACITY) {
+    memcpy(inlineChars, from, length);
+    return;
+  }
+  chars = from;
+  // A slice of a slice shares the original's storage directly.
+  left = whole->left != nullptr && whole->chars != nullptr ? whole->left
+                                                            : std::move(whole);
+}
+
+String::String(size_t length, Heap *heap)
+    : length(length), cachedHash(0), heap(heap), chars(inlineChars) {
+  if (length > INLINE_CAPACITY) {
+    if (heap != nullptr)
+      heap->charge(length);
+    outOfLine.reset(new char[length]);
+    chars = outOfLine.get();
+  }
+}
+
+// A string built by appending in a loop is a rope as deep as the loop ran
+// long, so neither flattening nor destruction may recurse into it.
+void String::release(std::shared_ptr<String> left,
+                     std::shared_ptr<String> right) {
+  std::vector<std::shared_ptr<String>> doomed;
+  if (left != nullptr)
+    doomed.push_back(std::move(left));
+  if (right != nullptr)
+    doomed.push_back(std::move(right));
+  while (!doomed.empty()) {
+    auto node = std::move(doomed.back());
+    doomed.pop_back();
+    if (node.use_count() == 1) {
+      if (node->left != nullptr)
+        doomed.push_back(std::move(node->left));
+      if (node->right != nullptr)
+        doomed.push_back(std::move(node->right));
+    }
+  }
+}
+
+String::~String() {
+  if (outOfLine != nullptr && heap != nullptr)
+    heap->credit(length);
+  if (left != nullptr)
+    release(std::move(left), std::move(right));
+}
+
+void String::flatten() const {
+  if (heap != nullptr)
+    heap->charge(length);
+  auto buffer = std::make_unique<char[]>(length);
+  size_t pos = 0;
+  std::vector<const String *> pending = {this};
+  while (!pending.empty()) {
+    auto node = pending.back();
+    pending.pop_back();
+    if (node->chars != nullptr) {
+      memcpy(buffer.get() + pos, node->chars, node->length);
+      pos += node->length;
+    } else {
+      pending.push_back(node->right.get());
+      pending.push_back(node->left.get());
+    }
+  }
+  outOfLine = std::move(buffer);
+  chars = outOfLine.get();
+  release(std::move(left), std::move(right));
+}
+
+void String::computeHash() const {
+  auto h = std::hash<std::string_view>()(view());
+  cachedHash = h != 0 ? h : 1;
+}
+
+bool String::operator==(const String &other) const {
+  if (this == &other)
+    return true;
+  if (length != other.length)
+    return false;
+  if (cachedHash != 0 && other.cachedHash != 0 &&
+      cachedHash != other.cachedHash)
+    return false;
+  return view() == other.view();
+}
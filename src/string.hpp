@@ -0,0 +1,63 @@
+#pragma once
+#include "heap.hpp"
+#include <cstddef>
+#include <memory>
+#include <string_view>
+
+// Immutable Lox string. Short strings keep their characters inline. Joining
+// two long strings only makes a rope node pointing at both halves; the
+// characters are copied out the first time anyone looks at them, so building
+// a string one piece at a time costs O(1) per append plus one final copy.
+//
+// Strings a script makes are charged to its Heap, characters and all; those
+// with no heap (literals, say) belong to the host.
+class String {
+public:
+  static constexpr size_t INLINE_CAPACITY = 24;
+  // A rope can claim any length without holding the characters; keep the
+  // claim to something that could be flattened.
+  static constexpr size_t MAX_SIZE = size_t(1) << 32;
+
+  explicit String(std::string_view chars, Heap *heap = nullptr);
+  String(std::shared_ptr<String> left, std::shared_ptr<String> right,
+         Heap *heap = nullptr);
+  // Characters [offset, offset + length) of whole. Long slices point into
+  // whole's characters and keep it alive instead of copying them.
+  String(std::shared_ptr<String> whole, size_t offset, size_t length,
+         Heap *heap = nullptr);
+  // length uninitialised characters, for a reader to fill through buffer()
+  // before the string is shared with anyone.
+  String(size_t length, Heap *heap);
+  String(const String &) = delete;
+  String &operator=(const String &) = delete;
+  ~String();
+
+  size_t size() const { return length; }
+  std::string_view view() const {
+    if (chars == nullptr)
+      flatten();
+    return std::string_view(chars, length);
+  }
+  size_t hash() const {
+    if (cachedHash == 0)
+      computeHash();
+    return cachedHash;
+  }
+  bool operator==(const String &other) const;
+  char *buffer() { return const_cast<char *>(view().data()); }
+
+private:
+  size_t length;
+  mutable size_t cachedHash;
+  Heap *heap;
+  // Null while this is an unflattened rope. A slice's point into left.
+  mutable const char *chars;
+  mutable std::unique_ptr<char[]> outOfLine;
+  mutable std::shared_ptr<String> left, right;
+  char inlineChars[INLINE_CAPACITY];
+
+  static void release(std::shared_ptr<String> left,
+                      std::shared_ptr<String> right);
+  void flatten() const;
+  void computeHash() const;
+};
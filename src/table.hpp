@@ -0,0 +1,148 @@
+#pragma once
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Open-addressing hash table from strings to V, with linear probing. Every
+// slot keeps its key's hash, so probing compares strings only on a full hash
+// match and growing never rehashes a key. Erased slots become tombstones;
+// when those crowd the table it is rebuilt at the same size instead of
+// doubling.
+//
+// Slots and the keys in them come from Allocator, rebound as needed.
+template <typename V, typename Allocator = std::allocator<char>>
+class HashTable {
+  // Real hashes are kept clear of the two marker values.
+  static constexpr size_t EMPTY = 0;
+  static constexpr size_t TOMBSTONE = 1;
+  static constexpr size_t MIN_CAPACITY = 16;
+
+  template <typename T>
+  using Rebind =
+      typename std::allocator_traits<Allocator>::template rebind_alloc<T>;
+  typedef std::basic_string<char, std::char_traits<char>, Rebind<char>> Key;
+  struct Slot {
+    size_t hash;
+    Key key;
+    V value;
+    Slot(const Allocator &alloc) : hash(EMPTY), key(alloc), value() {}
+  };
+  Allocator alloc;
+  std::vector<Slot, Rebind<Slot>> slots;
+  size_t live = 0;
+  size_t tombstones = 0;
+
+  static size_t hashOf(std::string_view key) {
+    auto h = std::hash<std::string_view>()(key);
+    return h > TOMBSTONE ? h : h + 2;
+  }
+
+  Slot *lookup(std::string_view key, size_t hash) {
+    if (slots.empty())
+      return nullptr;
+    size_t mask = slots.size() - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+      auto &slot = slots[i];
+      if (slot.hash == EMPTY)
+        return nullptr;
+      if (slot.hash == hash && slot.key == key)
+        return &slot;
+    }
+  }
+
+  void rebuild(size_t capacity) {
+    std::vector<Slot, Rebind<Slot>> old(capacity, Slot(alloc), alloc);
+    old.swap(slots);
+    tombstones = 0;
+    size_t mask = capacity - 1;
+    for (auto &slot : old) {
+      if (slot.hash <= TOMBSTONE)
+        continue;
+      size_t i = slot.hash & mask;
+      while (slots[i].hash != EMPTY) {
+        i = (i + 1) & mask;
+      }
+      slots[i] = std::move(slot);
+    }
+  }
+
+public:
+  HashTable(const Allocator &alloc = Allocator())
+      : alloc(alloc), slots(alloc) {}
+
+  size_t size() const { return live; }
+  size_t capacity() const { return slots.size(); }
+
+  V *find(std::string_view key) {
+    auto slot = lookup(key, hashOf(key));
+    return slot != nullptr ? &slot->value : nullptr;
+  }
+
+  // Inserts or overwrites.
+  V &insert(std::string_view key, V value) {
+    auto hash = hashOf(key);
+    if (auto slot = lookup(key, hash)) {
+      slot->value = std::move(value);
+      return slot->value;
+    }
+    // Keep at most 3/4 of the slots occupied, tombstones included.
+    if ((live + tombstones + 1) * 4 > slots.size() * 3) {
+      if (slots.empty())
+        rebuild(MIN_CAPACITY);
+      else
+        rebuild(live * 2 < slots.size() ? slots.size() : slots.size() * 2);
+    }
+    size_t mask = slots.size() - 1;
+    size_t i = hash & mask;
+    while (slots[i].hash > TOMBSTONE) {
+      i = (i + 1) & mask;
+    }
+    auto &slot = slots[i];
+    if (slot.hash == TOMBSTONE)
+      tombstones--;
+    slot.hash = hash;
+    slot.key = key;
+    slot.value = std::move(value);
+    live++;
+    return slot.value;
+  }
+
+  bool erase(std::string_view key) {
+    auto slot = lookup(key, hashOf(key));
+    if (slot == nullptr)
+      return false;
+    slot->hash = TOMBSTONE;
+    slot->key.clear();
+    slot->value = V();
+    live--;
+    tombstones++;
+    return true;
+  }
+
+  // Empties the table but keeps its slots.
+  void clear() {
+    for (auto &slot : slots) {
+      if (slot.hash != EMPTY) {
+        slot.hash = EMPTY;
+        slot.key.clear();
+        slot.value = V();
+      }
+    }
+    live = tombstones = 0;
+  }
+
+  template <typename F> void forEach(F f) {
+    for (auto &slot : slots) {
+      if (slot.hash > TOMBSTONE)
+        f(slot.key, slot.value);
+    }
+  }
+  template <typename F> void forEach(F f) const {
+    for (auto &slot : slots) {
+      if (slot.hash > TOMBSTONE)
+        f(slot.key, slot.value);
+    }
+  }
+};
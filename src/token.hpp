@@ -1,5 +1,8 @@
 #pragma once
+#include <cstdint>
 #include <string>
+#include <string_view>
+#include <vector>
 
 enum class TokenType {
   // Single-character tokens.
@@ -7,6 +10,8 @@ enum class TokenType {
   T_RIGHT_PAREN,
   T_LEFT_BRACE,
   T_RIGHT_BRACE,
+  T_LEFT_BRACKET,
+  T_RIGHT_BRACKET,
   T_COMMA,
   T_DOT,
   T_MINUS,
@@ -32,7 +37,9 @@ enum class TokenType {
 
   // Keywords.
   T_AND,
+  T_BREAK,
   T_CLASS,
+  T_CONTINUE,
   T_ELSE,
   T_FALSE,
   T_FUN,
@@ -62,6 +69,10 @@ constexpr const char *token_name(TokenType token) {
     return "T_LEFT_BRACE";
   case TokenType::T_RIGHT_BRACE:
     return "T_RIGHT_BRACE";
+  case TokenType::T_LEFT_BRACKET:
+    return "T_LEFT_BRACKET";
+  case TokenType::T_RIGHT_BRACKET:
+    return "T_RIGHT_BRACKET";
   case TokenType::T_COMMA:
     return "T_COMMA";
   case TokenType::T_DOT:
@@ -106,8 +117,12 @@ constexpr const char *token_name(TokenType token) {
   // Keywords.
   case TokenType::T_AND:
     return "T_AND";
+  case TokenType::T_BREAK:
+    return "T_BREAK";
   case TokenType::T_CLASS:
     return "T_CLASS";
+  case TokenType::T_CONTINUE:
+    return "T_CONTINUE";
   case TokenType::T_ELSE:
     return "T_ELSE";
   case TokenType::T_FALSE:
@@ -145,8 +160,21 @@ constexpr const char *token_name(TokenType token) {
   return nullptr;
 }
 
-struct Token {
-  TokenType type;
-  std::string lexeme;
-  size_t pos;
+// Tokens are stored column-wise so the parser can scan the type array without
+// dragging lexemes through the cache. Lexemes are slices of the owned source.
+struct TokenStream {
+  std::string source;
+  std::vector<TokenType> types;
+  std::vector<uint32_t> offsets;
+  std::vector<uint32_t> lengths;
+
+  size_t size() const { return types.size(); }
+  std::string_view lexeme(size_t i) const {
+    return std::string_view(source).substr(offsets[i], lengths[i]);
+  }
+  void push(TokenType type, size_t offset, size_t length) {
+    types.push_back(type);
+    offsets.push_back(offset);
+    lengths.push_back(length);
+  }
 };
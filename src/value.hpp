@@ -0,0 +1,192 @@
+#pragma once
+#include "string.hpp"
+#include <cmath>
+#include <limits>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <variant>
+
+// Integral numbers are kept as int64_t while they stay within the range a
+// double represents exactly. Inside that range integer and double arithmetic
+// agree bit for bit, so scripts can't tell which representation they got.
+constexpr int64_t MAX_SAFE_INT = int64_t(1) << 53;
+
+struct Function;
+struct Native;
+struct Channel;
+struct Array;
+struct List;
+struct Dict;
+
+typedef std::variant<std::nullptr_t, bool, int64_t, double,
+                     std::shared_ptr<Function>, std::shared_ptr<Native>,
+                     std::shared_ptr<Channel>, std::shared_ptr<Array>,
+                     std::shared_ptr<List>, std::shared_ptr<Dict>,
+                     std::shared_ptr<String>>
+    Value;
+
+inline bool isSafeInt(int64_t i) {
+  return i >= -MAX_SAFE_INT && i <= MAX_SAFE_INT;
+}
+
+inline bool isNumber(const Value &val) {
+  return std::holds_alternative<int64_t>(val) ||
+         std::holds_alternative<double>(val);
+}
+
+inline bool isTruthy(const Value &val) {
+  if (auto i = std::get_if<int64_t>(&val)) {
+    return *i != 0;
+  }
+  if (auto d = std::get_if<double>(&val)) {
+    return *d != 0.0;
+  }
+  if (auto b = std::get_if<bool>(&val)) {
+    return *b;
+  }
+  return true;
+}
+
+inline double asNumber(const Value &val) {
+  if (auto i = std::get_if<int64_t>(&val)) {
+    return *i;
+  }
+  if (auto d = std::get_if<double>(&val)) {
+    return *d;
+  }
+  throw "Operand must be a number";
+}
+
+// Checks that index is a whole number within [0, size).
+inline size_t toIndex(const Value &index, size_t size) {
+  if (auto i = std::get_if<int64_t>(&index)) {
+    if (*i < 0 || uint64_t(*i) >= size)
+      throw "Index out of range";
+    return size_t(*i);
+  }
+  double d = asNumber(index);
+  // Checked as a double first: NaN, infinities and anything past int64_t
+  // can't be converted.
+  if (d != std::floor(d))
+    throw "Index must be an integer";
+  if (!(d >= 0 && d < double(size)))
+    throw "Index out of range";
+  return size_t(d);
+}
+
+inline std::string toString(const Value &val) {
+  if (auto i = std::get_if<int64_t>(&val)) {
+    // Same text std::to_string(double) produces for an integral value.
+    return std::to_string(*i) + ".000000";
+  }
+  if (auto d = std::get_if<double>(&val)) {
+    return std::to_string(*d);
+  }
+  if (auto b = std::get_if<bool>(&val)) {
+    return std::to_string(*b);
+  }
+  if (auto str = std::get_if<std::shared_ptr<String>>(&val)) {
+    return std::string((*str)->view());
+  }
+  if (std::holds_alternative<std::shared_ptr<Function>>(val)) {
+    return "<fn>";
+  }
+  if (std::holds_alternative<std::shared_ptr<Native>>(val)) {
+    return "<native fn>";
+  }
+  if (std::holds_alternative<std::shared_ptr<Channel>>(val)) {
+    return "<channel>";
+  }
+  if (std::holds_alternative<std::shared_ptr<Array>>(val)) {
+    return "<array>";
+  }
+  if (std::holds_alternative<std::shared_ptr<List>>(val)) {
+    return "<list>";
+  }
+  if (std::holds_alternative<std::shared_ptr<Dict>>(val)) {
+    return "<dict>";
+  }
+  return "n/a";
+}
+
+// Numbers compare by value whatever their representation, strings by
+// content.
+inline bool valuesEqual(const Value &lhs, const Value &rhs) {
+  if (isNumber(lhs) && isNumber(rhs)) {
+    auto li = std::get_if<int64_t>(&lhs), ri = std::get_if<int64_t>(&rhs);
+    if (li && ri)
+      return *li == *ri;
+    return asNumber(lhs) == asNumber(rhs);
+  }
+  auto ls = std::get_if<std::shared_ptr<String>>(&lhs);
+  auto rs = std::get_if<std::shared_ptr<String>>(&rhs);
+  if (ls && rs)
+    return **ls == **rs;
+  return lhs == rhs;
+}
+
+// Conversions used when C++ code passes values into or out of a script.
+template <typename T> Value toValue(T val) {
+  if constexpr (std::is_same_v<T, bool>) {
+    return val;
+  } else if constexpr (std::is_unsigned_v<T>) {
+    if (val <= uint64_t(MAX_SAFE_INT))
+      return int64_t(val);
+    return double(val);
+  } else if constexpr (std::is_integral_v<T>) {
+    if (isSafeInt(val))
+      return int64_t(val);
+    return double(val);
+  } else if constexpr (std::is_floating_point_v<T>) {
+    return double(val);
+  } else {
+    return Value(std::move(val));
+  }
+}
+
+template <typename T> T fromValue(const Value &val) {
+  if constexpr (std::is_same_v<T, Value>) {
+    return val;
+  } else if constexpr (std::is_same_v<T, void>) {
+    return;
+  } else if constexpr (std::is_same_v<T, bool>) {
+    return isTruthy(val);
+  } else if constexpr (std::is_integral_v<T>) {
+    using limits = std::numeric_limits<T>;
+    if (auto i = std::get_if<int64_t>(&val)) {
+      if (*i < 0 ? !limits::is_signed || *i < int64_t(limits::min())
+                 : uint64_t(*i) > uint64_t(limits::max()))
+        throw "Value out of range";
+      return T(*i);
+    }
+    // As in toIndex: NaN, infinities and anything past T can't be converted.
+    double d = asNumber(val);
+    if (d != std::floor(d))
+      throw "Value has the wrong type";
+    double bound = std::ldexp(1.0, limits::digits);
+    if (!(d >= (limits::is_signed ? -bound : 0) && d < bound))
+      throw "Value out of range";
+    return T(d);
+  } else if constexpr (std::is_floating_point_v<T>) {
+    double d = asNumber(val);
+    if (std::isfinite(d) &&
+        std::fabs(d) > double(std::numeric_limits<T>::max()))
+      throw "Value out of range";
+    return T(d);
+  } else {
+    if (auto v = std::get_if<T>(&val))
+      return *v;
+    throw "Value has the wrong type";
+  }
+}
+
+inline std::ostream &operator<<(std::ostream &os, const Value &val) {
+  if (isNumber(val))
+    return os << asNumber(val);
+  if (auto b = std::get_if<bool>(&val))
+    return os << (*b ? "true" : "false");
+  return os << "nil";
+}